@@ -1,30 +1,677 @@
+#include <math.h>
+#include <stddef.h>
+
 #include <test/test.h>
 
 #include <conversions/conversions.h>
 
+#include "../../src/can_commands.h"
 #include "../../src/heaters.h"
 
+#define ASSERT_BETWEEN(least, greatest, value) \
+    ASSERT_GREATER(value, (least) - 1); \
+    ASSERT_LESS(value, (greatest) + 1);
+
 // 2
 void count_ones_test(void) {
-    uint8_t array1[12] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
-    ASSERT_EQ(count_ones(array1, 12), 12);
+    ASSERT_EQ(count_ones(0x0FFF), 12);
+    ASSERT_EQ(count_ones(0x0000), 0);
+    ASSERT_EQ(count_ones(0x0989), 5);
+    ASSERT_EQ(count_ones(0xFFFF), 16);
+}
+
+void avg_therm_readings_test(void) {
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+        therm_readings_conv[i] = 1000 + (100 * i);
+    }
+    invalid_therm_reading_conv = 2000;
+
+    therm_enables = THERM_MASK_ALL;
+    ASSERT_EQ(avg_therm_readings(HEATER2_THERM_MASK), 1400);
+    ASSERT_EQ(avg_therm_readings(HEATER4_THERM_MASK), 1700);
+    ASSERT_EQ(avg_therm_readings(HEATER5_THERM_MASK), 1550);
+
+    // Only the enabled thermistors in the zone are averaged
+    therm_enables = 0x0FF7;
+    ASSERT_EQ(avg_therm_readings(HEATER2_THERM_MASK), 1450);
+
+    // No enabled thermistors in the zone
+    therm_enables = 0x0E07;
+    ASSERT_EQ(avg_therm_readings(HEATER2_THERM_MASK), 2000);
+}
+
+void therm_outlier_test(void) {
+    int16_t vals1[] = { 5, -3, 8, 8, 1, 12, 0 };
+    ASSERT_EQ(select_kth(vals1, 7, 0), -3);
+    ASSERT_EQ(select_kth(vals1, 7, 6), 12);
+    ASSERT_EQ(median_centi(vals1, 7), 5);
+    int16_t vals2[] = { 5, -3, 8, 8, 1, 12 };
+    ASSERT_EQ(median_centi(vals2, 6), 6);
+
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+        therm_err_codes[i] = THERM_ERR_CODE_NORMAL;
+        therm_readings_raw[i] = 0x400;
+        therm_readings_conv[i] = 2000 + (20 * i);
+    }
+    therm_ull_raw = 0x100;
+    therm_uhl_raw = 0xF00;
+
+    // One wild reading (still within the limits) should be the only one
+    // eliminated, even though it moves the mean by ~10 C
+    therm_readings_conv[3] = 12000;
+    update_therm_statuses();
+    ASSERT_EQ(therm_enables, THERM_MASK_ALL & ~_BV(3));
+    ASSERT_EQ(therm_err_codes[3], THERM_ERR_CODE_ABOVE_MIU);
+    ASSERT_EQ(therm_err_codes[4], THERM_ERR_CODE_NORMAL);
+
+    // A thermistor next to an ON heater reading 6 C above the rest is kept
+    therm_readings_conv[3] = 2800;
+    update_therm_statuses();
+    ASSERT_EQ(therm_enables, THERM_MASK_ALL);
+    therm_readings_conv[3] = 12000;
+
+    // Manually set thermistors are not eliminated
+    therm_err_codes[3] = THERM_ERR_CODE_MANUAL_VALID;
+    therm_readings_conv[5] = -1000;
+    update_therm_statuses();
+    ASSERT_EQ(therm_enables, THERM_MASK_ALL & ~_BV(5));
+    ASSERT_EQ(therm_err_codes[5], THERM_ERR_CODE_BELOW_MIU);
+
+    // Zone 4 (TH7-9) held ~15 C above the rest with its own setpoint - no
+    // thermistors are eliminated, even though TH8-9 are also in zone 3
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+        therm_err_codes[i] = THERM_ERR_CODE_NORMAL;
+        if (HEATER4_THERM_MASK & _BV(i)) {
+            therm_readings_conv[i] = 3500 + (20 * i);
+        } else {
+            therm_readings_conv[i] = 2000 + (20 * i);
+        }
+    }
+    update_therm_statuses();
+    ASSERT_EQ(therm_enables, THERM_MASK_ALL);
+}
+
+// The single pass over all zones should match averaging each zone separately
+void heater_zone_temps_test(void) {
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+        therm_readings_conv[i] = 1000 + (100 * i);
+    }
+    invalid_therm_reading_conv = 2000;
+
+    uint16_t enables[] = { THERM_MASK_ALL, 0x0FF7, 0x0E07, 0x0000 };
+    for (uint8_t i = 0; i < sizeof(enables) / sizeof(enables[0]); i++) {
+        therm_enables = enables[i];
+        update_heater_zone_temps();
+        for (uint8_t j = 0; j < HEATER_COUNT; j++) {
+            ASSERT_EQ(heater_zone_temps[j],
+                avg_therm_readings(heater_zone_masks[j]));
+        }
+    }
+}
+
+void heater_pid_test(void) {
+    pid_state_t pid;
+    reset_pid(&pid);
+
+    // Proportional only - full duty at 3 C below the setpoint
+    pid_gains_t p_gains = { .kp = PID_KP_DEFAULT, .ki = 0, .kd = 0 };
+    ASSERT_EQ(run_pid(&pid, &p_gains, 1400, 1500, 60, 0), 0);
+    ASSERT_EQ(run_pid(&pid, &p_gains, 1400, 1400, 60, 0), 0);
+    ASSERT_EQ(run_pid(&pid, &p_gains, 1400, 1250, 60, 0), 50);
+    ASSERT_EQ(run_pid(&pid, &p_gains, 1400, 1100, 60, 0), 100);
+    ASSERT_EQ(run_pid(&pid, &p_gains, 1400, -4000, 60, 0), 100);
+
+    // Output can only change by the rate limit each step
+    ASSERT_EQ(run_pid(&pid, &p_gains, 1400, 1500, 60, 25), 75);
+    ASSERT_EQ(run_pid(&pid, &p_gains, 1400, 1500, 60, 25), 50);
+
+    // The largest gains with the largest errors must not overflow
+    pid_gains_t max_gains = { .kp = PID_GAIN_MAX, .ki = PID_GAIN_MAX, .kd = PID_GAIN_MAX };
+    reset_pid(&pid);
+    ASSERT_EQ(run_pid(&pid, &max_gains, INT16_MAX, INT16_MIN, 60, 0), 100);
+    ASSERT_EQ(run_pid(&pid, &max_gains, INT16_MIN, INT16_MAX, 60, 0), 0);
+    ASSERT_EQ(run_pid(&pid, &max_gains, INT16_MAX, INT16_MIN, 60, 0), 100);
+    // Gains that could overflow are rejected
+    uint16_t prev_kp = heater_pid_gains.kp;
+    ASSERT_FALSE(set_heater_pid_gain(HEATER_PID_KP, PID_GAIN_MAX + 1));
+    ASSERT_FALSE(set_heater_pid_gain(HEATER_PID_KD, UINT16_MAX));
+    ASSERT_EQ(heater_pid_gains.kp, prev_kp);
+
+    // Integral only - a constant error should increase the output each step,
+    // but it should stop at full duty (anti-windup)
+    pid_gains_t i_gains = { .kp = 0, .ki = PID_KI_DEFAULT, .kd = 0 };
+    reset_pid(&pid);
+    uint8_t prev = 0;
+    for (uint8_t i = 0; i < 10; i++) {
+        uint8_t duty = run_pid(&pid, &i_gains, 1400, 1300, 600, 0);
+        ASSERT_GREATER(duty, prev);
+        prev = duty;
+    }
+    for (uint16_t i = 0; i < 1000; i++) {
+        run_pid(&pid, &i_gains, 1400, -4000, 300, 0);
+    }
+    ASSERT_EQ(pid.output, 100);
+    ASSERT_EQ(pid.integral, PID_OUT_MAX_FIXED);
+    // Since the integral did not wind up, it comes off full duty as soon as the
+    // error changes sign
+    ASSERT_LESS(run_pid(&pid, &i_gains, 1400, 1500, 60, 0), 100);
+
+    // Bang-bang mode
+    heater_ctrl_mode = HEATER_CTRL_MODE_BANG_BANG;
+    heater_zone_setpoints_conv[0] = 1400;
+    heater_duties[0] = 0;
+    ASSERT_EQ(calc_heater_duty(0, 1500), 0);
+    ASSERT_EQ(calc_heater_duty(0, 1300), HEATER_DUTY_MAX);
+    heater_ctrl_mode = HEATER_CTRL_MODE_DEFAULT;
+}
+
+void heater_pwm_test(void) {
+    // Each heater should be ON for its duty cycle of the period, and no more
+    // than 3 heaters should be ON at the same time with these duty cycles
+    heater_ctrl_period_s = 60;
+    uint8_t duties[HEATER_COUNT] = { 0, 25, 50, 60, HEATER_DUTY_MAX };
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_duties[i] = duties[i];
+    }
+
+    uint8_t on_time_s[HEATER_COUNT] = { 0 };
+    uint8_t max_on = 0;
+    for (uint32_t phase_s = 0; phase_s < heater_ctrl_period_s; phase_s++) {
+        uint8_t mask = heater_pwm_mask(phase_s);
+        for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+            if (mask & _BV(i)) {
+                on_time_s[i] += 1;
+            }
+        }
+        if (count_ones(mask) > max_on) {
+            max_on = count_ones(mask);
+        }
+    }
+
+    ASSERT_EQ(on_time_s[0], 0);
+    ASSERT_EQ(on_time_s[1], 15);
+    ASSERT_EQ(on_time_s[2], 30);
+    ASSERT_EQ(on_time_s[3], 36);
+    ASSERT_EQ(on_time_s[4], 60);
+    ASSERT_LESS(max_on, 4);
+}
+
+void heater_start_seq_test(void) {
+    heater_start_spacing_s = 2;
+    heater_max_active = 3;
+    heater_boost6_curr_budget_ma = HEATER_BOOST6_CURR_BUDGET_NONE;
+    heater_last_start_time = 0;
+    heater_last_started = HEATER_COUNT - 1;
+
+    // All heaters wanted at once - should start one every 2 s, up to 3
+    uint8_t mask = 0;
+    mask = sequence_heater_starts(mask, HEATER_MASK_ALL, 10);
+    ASSERT_EQ(mask, 0x01);
+    mask = sequence_heater_starts(mask, HEATER_MASK_ALL, 11);
+    ASSERT_EQ(mask, 0x01);
+    mask = sequence_heater_starts(mask, HEATER_MASK_ALL, 12);
+    ASSERT_EQ(mask, 0x03);
+    mask = sequence_heater_starts(mask, HEATER_MASK_ALL, 14);
+    ASSERT_EQ(mask, 0x07);
+    mask = sequence_heater_starts(mask, HEATER_MASK_ALL, 16);
+    ASSERT_EQ(mask, 0x07);
+
+    // Turning off is immediate, and the next heater in turn starts
+    mask = sequence_heater_starts(mask, 0x1A, 18);
+    ASSERT_EQ(mask, 0x0A);
+    mask = sequence_heater_starts(mask, 0x1A, 20);
+    ASSERT_EQ(mask, 0x1A);
+    mask = sequence_heater_starts(mask, 0x00, 20);
+    ASSERT_EQ(mask, 0x00);
+
+    // With the default limits, the starts are spread out but every heater can
+    // be ON
+    heater_start_spacing_s = HEATER_START_SPACING_S;
+    heater_max_active = HEATER_MAX_ACTIVE_DEFAULT;
+    mask = sequence_heater_starts(mask, HEATER_MASK_ALL, 30);
+    ASSERT_EQ(count_ones(mask), 1);
+    for (uint32_t now = 31; now < 40; now++) {
+        mask = sequence_heater_starts(mask, HEATER_MASK_ALL, now);
+    }
+    ASSERT_EQ(mask, HEATER_MASK_ALL);
+
+    // With 450 mA measured, heater 5 (175 mA) would go over a 600 mA budget
+    // but heater 2 (100 mA) wouldn't
+    heater_boost6_curr_budget_ma = 600;
+    update_heater_start_thresholds();
+    uint16_t curr_raw = boost6_curr_ma_to_adc_raw(450);
+    ASSERT_FALSE(heater_curr_within_budget(4, curr_raw));
+    ASSERT_TRUE(heater_curr_within_budget(1, curr_raw));
+    ASSERT_TRUE(heater_curr_within_budget(4, boost6_curr_ma_to_adc_raw(400)));
+
+    heater_boost6_curr_budget_ma = HEATER_BOOST6_CURR_BUDGET_MA;
+    update_heater_start_thresholds();
+}
+
+void thermal_model_test(void) {
+    // Zone that heats at 5 centi-degrees C/min per percent duty and cools at
+    // 2 C/min with the heater OFF, so 40% duty holds the temperature
+    thermal_model_t model;
+    reset_thermal_model(&model);
+    ASSERT_FALSE(thermal_model_valid(&model));
+
+    uint8_t duties[] = { 0, 50, 100, 25, 75, 10, 90, 40, 60, 30 };
+    for (uint8_t i = 0; i < 30; i++) {
+        uint8_t duty = duties[i % 10];
+        // Alternate +/- 0.05 C/min of noise
+        int32_t noise = (i % 2) ? 5 : -5;
+        update_thermal_model(&model, duty, (5 * duty) - 200 + noise);
+    }
+    ASSERT_TRUE(thermal_model_valid(&model));
+    ASSERT_BETWEEN(5 * 256 - 32, 5 * 256 + 32, model.gain);
+    ASSERT_BETWEEN(-200 * 256 - 1024, -200 * 256 + 1024,
+        thermal_model_off_rate(&model));
+    ASSERT_BETWEEN(39, 41, thermal_model_duty_for_rate(&model, 0));
+    ASSERT_BETWEEN(290, 310, thermal_model_rate(&model, 100));
+    ASSERT_EQ(thermal_model_duty_for_rate(&model, -1000), 0);
+    ASSERT_EQ(thermal_model_duty_for_rate(&model, 1000), 100);
+
+    // 2 C below the setpoint with a 60 s period - shouldn't use more than the
+    // duty cycle for 2 C/min
+    heater_ctrl_period_s = 60;
+    ASSERT_EQ(limit_heater_duty(&model, 2000, 1800, 30), 30);
+    ASSERT_BETWEEN(79, 81,
+        limit_heater_duty(&model, 2000, 1800, HEATER_DUTY_MAX));
+    ASSERT_BETWEEN(39, 41,
+        limit_heater_duty(&model, 2000, 2000, HEATER_DUTY_MAX));
+
+    // Not used until it has learned again
+    reset_thermal_model(&model);
+    ASSERT_EQ(limit_heater_duty(&model, 2000, 1800, HEATER_DUTY_MAX),
+        HEATER_DUTY_MAX);
+}
+
+void heater_switching_test(void) {
+    // Bang-bang with a 1 C band - no change within 0.5 C of the setpoint
+    heater_ctrl_mode = HEATER_CTRL_MODE_BANG_BANG;
+    heater_hyst_band_centi = 100;
+    heater_zone_setpoints_conv[0] = 2000;
+    reset_thermal_model(&heater_models[0]);
+    heater_duties[0] = 0;
+    ASSERT_EQ(calc_heater_duty(0, 1960), 0);
+    ASSERT_EQ(calc_heater_duty(0, 1940), HEATER_DUTY_MAX);
+    heater_duties[0] = HEATER_DUTY_MAX;
+    ASSERT_EQ(calc_heater_duty(0, 2040), HEATER_DUTY_MAX);
+    ASSERT_EQ(calc_heater_duty(0, 2060), 0);
+    heater_ctrl_mode = HEATER_CTRL_MODE_DEFAULT;
+    heater_hyst_band_centi = HEATER_HYST_BAND_CENTI_DEFAULT;
+
+    // Heater 1 switched ON at 100 s, heater 2 switched OFF at 98 s
+    heater_min_on_s = 5;
+    heater_min_off_s = 4;
+    heater_last_switch_time[0] = 100;
+    heater_last_switch_time[1] = 98;
+    ASSERT_EQ(apply_heater_dwell(0x01, 0x02, 100), 0x01);
+    ASSERT_EQ(apply_heater_dwell(0x01, 0x02, 101), 0x01);
+    ASSERT_EQ(apply_heater_dwell(0x01, 0x02, 102), 0x03);
+    ASSERT_EQ(apply_heater_dwell(0x01, 0x02, 105), 0x02);
+    // Heaters 3-5 haven't switched recently
+    ASSERT_EQ(apply_heater_dwell(0x01, 0x1D, 101), 0x1D);
+
+    // Dwell times also apply to the PWM windows
+    heater_ctrl_period_s = 60;
+    heater_duties[0] = 5;   // 3 s ON
+    heater_duties[1] = 95;  // 3 s OFF (from 9 to 12 s)
+    heater_duties[2] = 10;  // 6 s ON
+    ASSERT_EQ(heater_pwm_mask(0) & 0x01, 0x00);
+    ASSERT_EQ(heater_pwm_mask(10) & 0x02, 0x02);
+    ASSERT_EQ(heater_pwm_mask(24) & 0x04, 0x04);
+    heater_min_on_s = HEATER_MIN_ON_S_DEFAULT;
+    heater_min_off_s = HEATER_MIN_OFF_S_DEFAULT;
+
+    // Heaters ON with the main loop blocked since 100 s
+    uint8_t enables = heater_enables;
+    uint32_t last_update = heater_pwm_last_update_time;
+    bool armed = heater_pwm_armed;
+    heater_enables = 0x01;
+    heater_pwm_last_update_time = 100;
+    // Heaters switched directly (heater_ctrl_main() never ran) are left alone
+    heater_pwm_armed = false;
+    ASSERT_FALSE(heater_pwm_stalled(101 + HEATER_PWM_STALL_MAX_S));
+    heater_pwm_armed = true;
+    ASSERT_FALSE(heater_pwm_stalled(100 + HEATER_PWM_STALL_MAX_S));
+    ASSERT_TRUE(heater_pwm_stalled(101 + HEATER_PWM_STALL_MAX_S));
+    heater_enables = 0;
+    ASSERT_FALSE(heater_pwm_stalled(101 + HEATER_PWM_STALL_MAX_S));
+    heater_enables = enables;
+    heater_pwm_last_update_time = last_update;
+    heater_pwm_armed = armed;
+}
 
-    uint8_t array2[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-    ASSERT_EQ(count_ones(array2, 12), 0);
+void heater_safety_test(void) {
+    update_heater_thresholds();
+    heater_safety_limit_raw = therm_centi_to_adc_raw(HEATER_SAFETY_LIMIT_CENTI);
+    ASSERT_LESS(heater_safety_limit_raw, therm_uhl_raw);
+    ASSERT_FALSE(adc_raw_to_therm_centi(heater_safety_limit_raw - 1) >=
+        HEATER_SAFETY_LIMIT_CENTI);
+    ASSERT_TRUE(adc_raw_to_therm_centi(heater_safety_limit_raw) >=
+        HEATER_SAFETY_LIMIT_CENTI);
 
-    uint8_t array3[12] = { 1, 0, 0, 1, 0, 0, 0, 1, 1, 0, 0, 1 };
-    ASSERT_EQ(count_ones(array3, 12), 5);
+    ASSERT_FALSE(check_heater_safety_sample(heater_safety_limit_raw - 1));
+    ASSERT_TRUE(check_heater_safety_sample(heater_safety_limit_raw));
+    ASSERT_TRUE(check_heater_safety_sample(therm_uhl_raw));
+    // Failed thermistor, not a real temperature
+    ASSERT_FALSE(check_heater_safety_sample(therm_uhl_raw + 1));
 }
 
-void enables_to_uint_test(void) {
-    uint8_t array1[5] = { 1, 0, 0, 1, 1 };
-    ASSERT_EQ(enables_to_uint(array1, 5), 0x19);
+void heater_zone_setpoint_test(void) {
+    // Heaters 1-4 at 20 C and heater 5 at 40 C
+    uint16_t low_raw = heater_setpoint_to_dac_raw_data(20.0);
+    uint16_t high_raw = heater_setpoint_to_dac_raw_data(40.0);
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_zone_setpoints_raw[i] = (i < 4) ? low_raw : high_raw;
+    }
+    update_heater_thresholds();
+    ASSERT_BETWEEN(1975, 2025, heater_zone_setpoints_conv[0]);
+    ASSERT_BETWEEN(1975, 2025, heater_zone_setpoints_conv[3]);
+    ASSERT_BETWEEN(3975, 4025, heater_zone_setpoints_conv[4]);
+    ASSERT_EQ(get_heater_zone_setpoint_raw(4), high_raw);
+    ASSERT_EQ(get_heater_zone_setpoint_raw(HEATER_COUNT), 0);
 
-    uint8_t array2[12] = { 1, 0, 0, 1, 0, 0, 0, 0, 1, 1, 1, 1 };
-    ASSERT_EQ(enables_to_uint(array2, 12), 0xF09);
+    // At 30 C, only heater 5 should be ON
+    heater_ctrl_mode = HEATER_CTRL_MODE_BANG_BANG;
+    reset_thermal_model(&heater_models[0]);
+    reset_thermal_model(&heater_models[4]);
+    heater_duties[0] = 0;
+    heater_duties[4] = 0;
+    ASSERT_EQ(calc_heater_duty(0, 3000), 0);
+    ASSERT_EQ(calc_heater_duty(4, 3000), HEATER_DUTY_MAX);
+    heater_ctrl_mode = HEATER_CTRL_MODE_DEFAULT;
+
+    // The status record has each zone's setpoint
+    update_heater_ctrl_status();
+    ASSERT_EQ(heater_ctrl_status.heater_zone_setpoints_raw[0], low_raw);
+    ASSERT_EQ(heater_ctrl_status.heater_zone_setpoints_raw[4], high_raw);
+
+    // Restore the saved setpoints
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_zone_setpoints_raw[i] = config.heater_zone_setpoints_raw[i];
+    }
+    update_heater_thresholds();
+}
+
+void heater_ctrl_period_test(void) {
+    heater_zone_valid = HEATER_MASK_ALL;
+    heater_zone_prev_valid = 0;
+    heater_ctrl_period_s = HEATER_CTRL_PERIOD_S;
+
+    // Stable zones, but no previous temperatures yet
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_zone_setpoints_conv[i] = 1400;
+        heater_zone_temps[i] = 1400;
+    }
+    update_heater_ctrl_period();
+    ASSERT_EQ(heater_ctrl_period_s, HEATER_CTRL_PERIOD_MIN_S);
+
+    // Stable - should back off to the maximum
+    for (uint8_t i = 0; i < 10; i++) {
+        update_heater_ctrl_period();
+    }
+    ASSERT_EQ(heater_ctrl_period_s, HEATER_CTRL_PERIOD_MAX_S);
+
+    // Changing quickly (but still within the band)
+    heater_ctrl_period_s = HEATER_CTRL_PERIOD_MIN_S;
+    heater_zone_temps[2] = 1400 + (HEATER_CTRL_STABLE_BAND_CENTI / 2);
+    update_heater_ctrl_period();
+    ASSERT_EQ(heater_ctrl_period_s, HEATER_CTRL_PERIOD_MIN_S);
+    update_heater_ctrl_period();
+    ASSERT_EQ(heater_ctrl_period_s, HEATER_CTRL_PERIOD_MIN_S * 2);
+
+    // Outside the band
+    heater_zone_temps[2] = 1400 + (HEATER_CTRL_STABLE_BAND_CENTI * 2);
+    heater_zone_prev_temps[2] = heater_zone_temps[2];
+    update_heater_ctrl_period();
+    ASSERT_EQ(heater_ctrl_period_s, HEATER_CTRL_PERIOD_MIN_S);
+
+    // Zones without any thermistors don't count
+    heater_zone_valid = HEATER_MASK_ALL & ~_BV(2);
+    update_heater_ctrl_period();
+    ASSERT_EQ(heater_ctrl_period_s, HEATER_CTRL_PERIOD_MIN_S * 2);
+
+    heater_ctrl_period_s = HEATER_CTRL_PERIOD_S;
+}
+
+// Adds records until the history wraps around, then decodes it from the first
+// key record and checks the last record matches
+void therm_history_test(void) {
+    uint16_t codes[THERMISTOR_COUNT];
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+        codes[i] = 0x400 + (i * 0x10);
+    }
+
+    uint32_t time_s = 100;
+    for (uint8_t n = 0; n < 100; n++) {
+        // Mostly small changes, with a big one sometimes
+        for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+            codes[i] += (n % 10 == 0) ? 50 : (i % 3) - 1;
+        }
+        add_therm_history_record(time_s, codes, n & HEATER_MASK_ALL,
+            THERM_MASK_ALL);
+        time_s += 60;
+    }
+    ASSERT_LESS(therm_history.used, THERM_HISTORY_LEN + 1);
+    ASSERT_GREATER(therm_history.used, THERM_HISTORY_LEN -
+        THERM_HISTORY_MAX_RECORD_LEN);
+
+    uint16_t len = start_therm_history_read(time_s);
+    uint8_t buf[THERM_HISTORY_LEN];
+    for (uint16_t i = 0; i < len; i += 4) {
+        uint32_t data = read_therm_history(i);
+        for (uint8_t j = 0; j < 4 && i + j < len; j++) {
+            buf[i + j] = (data >> (24 - (8 * j))) & 0xFF;
+        }
+    }
+    ASSERT_FALSE(therm_history.reading);
+
+    uint32_t dec_time_s = 0;
+    uint16_t dec_codes[THERMISTOR_COUNT] = { 0 };
+    uint8_t dec_heaters = 0;
+    bool have_key = false;
+    uint16_t pos = 0;
+    while (pos < len) {
+        uint8_t header = buf[pos];
+        uint8_t* data = &buf[pos + 1];
+        if (header & THERM_HISTORY_KEY) {
+            have_key = true;
+            dec_time_s = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) |
+                ((uint32_t) data[2] << 8) | data[3];
+            data += 4;
+            for (uint8_t i = 0; i < THERMISTOR_COUNT; i++, data += 2) {
+                dec_codes[i] = ((uint16_t) data[0] << 8) | data[1];
+            }
+        } else {
+            dec_time_s += *data++;
+            for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+                if (header & THERM_HISTORY_NIBBLES) {
+                    int8_t nibble = (i % 2 == 0) ? (data[i / 2] >> 4) :
+                        (data[i / 2] & 0x0F);
+                    dec_codes[i] += (nibble & 0x08) ? nibble - 16 : nibble;
+                } else {
+                    dec_codes[i] += (int8_t) data[i];
+                }
+            }
+            data += (header & THERM_HISTORY_NIBBLES) ?
+                THERMISTOR_COUNT / 2 : THERMISTOR_COUNT;
+        }
+        if (header & THERM_HISTORY_HEATERS) {
+            dec_heaters = *data;
+        }
+        pos += therm_history_record_len(header);
+    }
+
+    ASSERT_TRUE(have_key);
+    ASSERT_EQ(pos, len);
+    ASSERT_EQ(dec_time_s, time_s - 60);
+    ASSERT_EQ(dec_heaters, 99 & HEATER_MASK_ALL);
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+        ASSERT_EQ(dec_codes[i], codes[i]);
+    }
+}
+
+// Uses an otherwise unused EEPROM region
+#define EEPROM_BLOCK_TEST_ADDR  0x710
+
+void eeprom_block_test(void) {
+    write_eeprom(EEPROM_BLOCK_TEST_ADDR, 0x44332211);
+    write_eeprom(EEPROM_BLOCK_TEST_ADDR + 4, 0x88776655);
+
+    // Same order as read_eeprom() for whole frames
+    eeprom_block_end = EEPROM_BLOCK_TEST_ADDR + 8;
+    ASSERT_EQ(read_eeprom_block(EEPROM_BLOCK_TEST_ADDR),
+        read_eeprom(EEPROM_BLOCK_TEST_ADDR));
+    // Bytes past the end of a 6 byte block are 0x00
+    eeprom_block_end = EEPROM_BLOCK_TEST_ADDR + 6;
+    ASSERT_EQ(read_eeprom_block(EEPROM_BLOCK_TEST_ADDR + 4), 0x00006655);
+    // Block ending at the last byte of EEPROM
+    eeprom_block_end = E2END + 1;
+    ASSERT_EQ(read_eeprom_block(E2END - 1) & 0xFFFF0000, 0);
+
+    write_eeprom(EEPROM_BLOCK_TEST_ADDR, EEPROM_DEF_DWORD);
+    write_eeprom(EEPROM_BLOCK_TEST_ADDR + 4, EEPROM_DEF_DWORD);
+
+    // A stream whose frames stopped being queued at 100 s is given up on
+    tx_stream.active = true;
+    tx_stream.last_frame_time_s = 100;
+    ASSERT_FALSE(tx_stream_timed_out(100 + TX_STREAM_TIMEOUT_S));
+    ASSERT_TRUE(tx_stream_timed_out(101 + TX_STREAM_TIMEOUT_S));
+    uint32_t aborts = tx_msg_stats.stream_aborts;
+    abort_tx_stream();
+    ASSERT_FALSE(tx_stream.active);
+    ASSERT_EQ(tx_msg_stats.stream_aborts, aborts + 1);
+    ASSERT_FALSE(tx_stream_timed_out(101 + TX_STREAM_TIMEOUT_S));
+}
+
+void heater_stats_test(void) {
+    for (uint8_t i = 0; i < HEATER_STATS_COUNT; i++) {
+        heater_on_time_s[i] = 0;
+        heater_energy_j[i] = 0;
+        heater_energy_mj[i] = 0;
+    }
+
+    // Heater 1 ON from 100 to 130 s, heater 2 ON from 110 s
+    heater_stats_switch(0x00, 0x01, 100);
+    heater_stats_switch(0x01, 0x03, 110);
+    heater_stats_switch(0x03, 0x02, 130);
+    ASSERT_EQ(get_heater_on_time_s(0, 0x02, 150), 30);
+    ASSERT_EQ(get_heater_on_time_s(1, 0x02, 150), 40);
+    ASSERT_EQ(get_heater_on_time_s(2, 0x02, 150), 0);
+    heater_stats_switch(0x02, 0x00, 160);
+    ASSERT_EQ(get_heater_on_time_s(1, 0x00, 200), 50);
+
+    // Heaters 2 and 4 have the same nominal current, so they should share
+    // the energy equally (1.5 J each, over 2 seconds)
+    add_heater_energy_mj(0x0A, 1500);
+    add_heater_energy_mj(0x0A, 1500);
+    ASSERT_EQ(heater_energy_j[1], 1);
+    ASSERT_EQ(heater_energy_mj[1], 500);
+    ASSERT_EQ(heater_energy_j[3], 1);
+    ASSERT_EQ(heater_energy_mj[3], 500);
+    ASSERT_EQ(heater_energy_j[0], 0);
+    // Nothing ON - nothing to add
+    add_heater_energy_mj(0x00, 1500);
+    ASSERT_EQ(heater_energy_j[1], 1);
+}
+
+// The board's configuration blocks, put back after config_test()
+uint8_t saved_config_eeprom[CONFIG_COPY_COUNT * CONFIG_COPY_LEN];
+
+// Erases both copies of the configuration block and loads the defaults
+void erase_config(void) {
+    for (uint16_t i = 0; i < CONFIG_COPY_COUNT * CONFIG_COPY_LEN; i += 4) {
+        write_eeprom(CONFIG_EEPROM_ADDR + i, EEPROM_DEF_DWORD);
+    }
+    config_loaded = false;
+    init_config();
+}
+
+void config_test(void) {
+    // Keep the setpoints, gains and heater stats stored on this board
+    eeprom_read_block(saved_config_eeprom, (void*) CONFIG_EEPROM_ADDR,
+        sizeof(saved_config_eeprom));
+
+    erase_config();
+    ASSERT_EQ(config_status, CONFIG_STATUS_ERASED);
+    ASSERT_EQ(config_copy, CONFIG_COPY_COUNT);
+    ASSERT_EQ(config.heaters_setpoint_raw, HEATERS_SETPOINT_RAW_DEFAULT);
+
+    // Sequence numbers wrapping around
+    ASSERT_TRUE(config_seq_newer(1, 0));
+    ASSERT_TRUE(config_seq_newer(0, CONFIG_SEQ_ERASED - 1));
+    ASSERT_FALSE(config_seq_newer(CONFIG_SEQ_ERASED - 1, 0));
+
+    // Each change should go to the other copy, and be found when reloaded
+    for (uint16_t i = 0; i < 3; i++) {
+        config.heaters_setpoint_raw = 0x200 + i;
+        ASSERT_TRUE(save_config());
+        ASSERT_EQ(config_copy, i % CONFIG_COPY_COUNT);
+
+        config.heaters_setpoint_raw = 0;
+        config_loaded = false;
+        init_config();
+        ASSERT_EQ(config_status, CONFIG_STATUS_OK);
+        ASSERT_EQ(config_copy, i % CONFIG_COPY_COUNT);
+        ASSERT_EQ(config.heaters_setpoint_raw, 0x200 + i);
+    }
+    // Nothing changed, so nothing should be written
+    ASSERT_FALSE(save_config());
+
+    // Corrupting the newest copy (like a write that didn't finish) should
+    // fall back to the previous one
+    uint16_t addr = CONFIG_EEPROM_ADDR + (config_copy * CONFIG_COPY_LEN);
+    write_eeprom(addr, read_eeprom(addr) ^ 0x01);
+    config_loaded = false;
+    init_config();
+    ASSERT_EQ(config_status, CONFIG_STATUS_OK);
+    ASSERT_EQ(config.heaters_setpoint_raw, 0x201);
+
+    // Neither copy valid - should use all the defaults
+    addr = CONFIG_EEPROM_ADDR + (config_copy * CONFIG_COPY_LEN);
+    write_eeprom(addr, read_eeprom(addr) ^ 0x01);
+    config_loaded = false;
+    init_config();
+    ASSERT_EQ(config_status, CONFIG_STATUS_INVALID);
+    ASSERT_EQ(config.heaters_setpoint_raw, HEATERS_SETPOINT_RAW_DEFAULT);
+    ASSERT_EQ(config.heater_pid_gains.kp, PID_KP_DEFAULT);
+
+    // Copy written by older firmware, without the fields from
+    // heater_switch_count on - should keep the fields it has, and use the
+    // defaults for the rest
+    config_block_t block;
+    block.version = CONFIG_VERSION;
+    block.len = offsetof(config_data_t, heater_switch_count);
+    block.seq = 0;
+    set_default_config(&block.data);
+    block.data.heaters_setpoint_raw = 0x234;
+    block.data.heater_on_time_s[0] = 1000;
+    block.data.heater_switch_count[0] = 50;
+    block.crc = calc_config_crc(&block);
+    eeprom_update_block(&block, (void*) CONFIG_EEPROM_ADDR, sizeof(block));
+    config_loaded = false;
+    init_config();
+    ASSERT_EQ(config_status, CONFIG_STATUS_OK);
+    ASSERT_EQ(config.heaters_setpoint_raw, 0x234);
+    ASSERT_EQ(config.heater_on_time_s[0], 1000);
+    ASSERT_EQ(config.heater_switch_count[0], 0);
+    // Saving should write the whole block to the other copy
+    ASSERT_TRUE(save_config());
+    ASSERT_EQ(config_copy, 1);
+    ASSERT_FALSE(save_config());
+
+    eeprom_update_block(saved_config_eeprom, (void*) CONFIG_EEPROM_ADDR,
+        sizeof(saved_config_eeprom));
+    config_loaded = false;
+    init_config();
 }
 
 void default_values_test(void) {
+    // Fixed layout of the binary status record
+    ASSERT_EQ(sizeof(heater_ctrl_status_t), HEATER_CTRL_STATUS_LEN);
+
     ASSERT_FP_EQ(adc_raw_to_therm_temp(HEATERS_SETPOINT_RAW_DEFAULT), 13.975);
     ASSERT_FP_EQ(adc_raw_to_therm_temp(INVALID_THERM_READING_RAW_DEFAULT), 19.988);
 
@@ -34,11 +681,70 @@ void default_values_test(void) {
     // print("0x%x\n", adc_ch_vol_to_raw(therm_res_to_vol(therm_temp_to_res(20))));
 }
 
+// Checks the integer lookup table conversion against the original floating
+// point conversion for every 12-bit ADC code
+void therm_lut_test(void) {
+    double max_err = 0.0;
+    uint16_t out_of_range_errs = 0;
+
+    for (uint16_t raw = 0; raw <= 0x0FFF; raw++) {
+        double expected = adc_raw_to_therm_temp(raw);
+        int16_t actual = adc_raw_to_therm_centi(raw);
+
+        if (expected >= THERM_LUT_MIN_CENTI / 100.0 &&
+                expected <= THERM_LUT_MAX_CENTI / 100.0) {
+            double err = fabs((actual / 100.0) - expected);
+            if (err > max_err) {
+                max_err = err;
+            }
+        }
+        // Outside the thermistor table range, should be clamped to one end
+        else if (actual != THERM_LUT_MIN_CENTI &&
+                actual != THERM_LUT_MAX_CENTI) {
+            out_of_range_errs += 1;
+        }
+    }
+
+    ASSERT_FP_LESS(max_err, THERM_LUT_TOLERANCE);
+    ASSERT_EQ(out_of_range_errs, 0);
+
+    // Readings with fractional bits (from the filter) should match on whole
+    // codes and be between the neighbouring codes otherwise
+    uint16_t frac_errs = 0;
+    for (uint16_t raw = 0x100; raw < 0xF00; raw++) {
+        uint32_t raw_frac = (uint32_t) raw << THERM_FILTER_SHIFT;
+        int16_t whole = adc_raw_frac_to_therm_centi(raw_frac, THERM_FILTER_SHIFT);
+        int16_t half = adc_raw_frac_to_therm_centi(
+            raw_frac + _BV(THERM_FILTER_SHIFT - 1), THERM_FILTER_SHIFT);
+        if (whole != adc_raw_to_therm_centi(raw) || half < whole ||
+                half > adc_raw_to_therm_centi(raw + 1)) {
+            frac_errs += 1;
+        }
+    }
+    ASSERT_EQ(frac_errs, 0);
+}
+
 test_t t1 = { .name = "count_ones_test", .fn = count_ones_test };
-test_t t2 = { .name = "enables_to_uint_test", .fn = enables_to_uint_test };
-test_t t3 = { .name = "default_values_test", .fn = default_values_test };
+test_t t2 = { .name = "avg_therm_readings_test", .fn = avg_therm_readings_test };
+test_t t3 = { .name = "therm_outlier_test", .fn = therm_outlier_test };
+test_t t4 = { .name = "heater_zone_temps_test", .fn = heater_zone_temps_test };
+test_t t5 = { .name = "heater_pid_test", .fn = heater_pid_test };
+test_t t6 = { .name = "heater_pwm_test", .fn = heater_pwm_test };
+test_t t7 = { .name = "heater_ctrl_period_test", .fn = heater_ctrl_period_test };
+test_t t8 = { .name = "therm_history_test", .fn = therm_history_test };
+test_t t9 = { .name = "default_values_test", .fn = default_values_test };
+test_t t10 = { .name = "therm_lut_test", .fn = therm_lut_test };
+test_t t11 = { .name = "config_test", .fn = config_test };
+test_t t12 = { .name = "heater_start_seq_test", .fn = heater_start_seq_test };
+test_t t13 = { .name = "thermal_model_test", .fn = thermal_model_test };
+test_t t14 = { .name = "heater_stats_test", .fn = heater_stats_test };
+test_t t15 = { .name = "heater_switching_test", .fn = heater_switching_test };
+test_t t16 = { .name = "heater_safety_test", .fn = heater_safety_test };
+test_t t17 = { .name = "heater_zone_setpoint_test", .fn = heater_zone_setpoint_test };
+test_t t18 = { .name = "eeprom_block_test", .fn = eeprom_block_test };
 
-test_t* suite[] = { &t1, &t2, &t3 };
+test_t* suite[] = { &t1, &t2, &t3, &t4, &t5, &t6, &t7, &t8, &t9, &t10, &t11,
+    &t12, &t13, &t14, &t15, &t16, &t17, &t18 };
 
 int main(void) {
     run_tests(suite, sizeof(suite) / sizeof(suite[0]));
@@ -22,6 +22,7 @@ int main(void){
     init_uptime();
 
     init_heater_ctrl();
+    init_heater_safety();
     print("\nHeaters Initialized\n");
 
     init_boosts ();
@@ -33,8 +34,12 @@ int main(void){
 
 
 
-    // Set update period
+    print_heater_ctrl = true;
+
+    // Set update period (fixed)
     heater_ctrl_period_s = 5;
+    heater_ctrl_period_min_s = 5;
+    heater_ctrl_period_max_s = 5;
 
     // Setpoints
     // set_heaters_setpoint_raw(0x2DD);    // 10 C
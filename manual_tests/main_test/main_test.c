@@ -172,12 +172,9 @@ void process_pay_opt_tx(uint8_t field_num, uint32_t tx_data) {
 }
 
 void process_pay_ctrl_tx(uint8_t field_num) {
-    // if (field_num == CAN_PAY_CTRL_HEAT_SP1) {
-    //     print("Set heaters 1-4 setpoint\n");
-    // } else if (field_num == CAN_PAY_CTRL_HEAT_SP2) {
-    //     print("Set heater 5 setpoint\n");
-    // }
-    if (field_num == CAN_PAY_CTRL_MOTOR_UP) {
+    if (field_num == CAN_PAY_CTRL_SET_HEAT_ZONE_SP) {
+        print("Set heater zone setpoint\n");
+    } else if (field_num == CAN_PAY_CTRL_MOTOR_UP) {
         print("Actuated plate up\n");
     } else if (field_num == CAN_PAY_CTRL_MOTOR_DOWN) {
         print("Actuated plate down\n");
@@ -232,31 +229,28 @@ void req_pay_opt_fn(void) {
     enqueue_rx_msg(CAN_PAY_OPT, 0, 0);
 }
 
+// Sets the setpoint of heaters first to last (1 to 5) to temp (in C)
+void set_heater_zone_sps(uint8_t first, uint8_t last, double temp) {
+    uint16_t raw_data = heater_setpoint_to_dac_raw_data(temp);
+    for (uint8_t i = first; i <= last; i++) {
+        enqueue_rx_msg(CAN_PAY_CTRL, CAN_PAY_CTRL_SET_HEAT_ZONE_SP,
+            ((uint32_t) (i - 1) << 16) | raw_data);
+    }
+}
+
 void set_heaters_1_4_0c_fn(void) {
-    // double res = therm_temp_to_res(0);
-    // double vol = therm_res_to_vol(res);
-    // uint16_t raw_data = dac_vol_to_raw_data(vol);
-    // enqueue_rx_msg(CAN_PAY_CTRL, CAN_PAY_CTRL_HEAT_SP1, raw_data);
+    set_heater_zone_sps(1, 4, 0);
 }
 void set_heaters_1_4_100c_fn(void) {
-    // double res = therm_temp_to_res(100);
-    // double vol = therm_res_to_vol(res);
-    // uint16_t raw_data = dac_vol_to_raw_data(vol);
-    // enqueue_rx_msg(CAN_PAY_CTRL, CAN_PAY_CTRL_HEAT_SP1, raw_data);
+    set_heater_zone_sps(1, 4, 100);
 }
 
 void set_heater_5_0c_fn(void) {
-    // double res = therm_temp_to_res(0);
-    // double vol = therm_res_to_vol(res);
-    // uint16_t raw_data = dac_vol_to_raw_data(vol);
-    // enqueue_rx_msg(CAN_PAY_CTRL, CAN_PAY_CTRL_HEAT_SP2, raw_data);
+    set_heater_zone_sps(5, 5, 0);
 }
 
 void set_heater_5_100c_fn(void) {
-    // double res = therm_temp_to_res(100);
-    // double vol = therm_res_to_vol(res);
-    // uint16_t raw_data = dac_vol_to_raw_data(vol);
-    // enqueue_rx_msg(CAN_PAY_CTRL, CAN_PAY_CTRL_HEAT_SP2, raw_data);
+    set_heater_zone_sps(5, 5, 100);
 }
 
 void req_act_up_fn(void) {
@@ -335,6 +329,7 @@ int main(void) {
     }
 
     // Run once at the beginning
+    print_heater_ctrl = true;
     run_heater_ctrl();
 
     print("At any time, press h to show the command menu\n");
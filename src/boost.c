@@ -13,25 +13,31 @@ void init_boosts(void) {
 
     // set 6V boost associated pins
     set_pex_pin_dir(&pex2, PEX_B, BST_SIX_ENBL, OUTPUT);
-    set_pex_pin(&pex2, PEX_B, BST_SIX_ENBL, 0);
+    update_pex2_bank_b(_BV(BST_SIX_ENBL), 0);
 }
 
 void enable_10V_boost(void) {
     // Enable 10V boost converter by setting corresponding pex pin HIGH
+    claim_spi_bus();
     set_pex_pin(&pex2, PEX_A, BST_TEN_ENBL, 1);
+    release_spi_bus();
 }
 
 void disable_10V_boost(void) {
     // Disable 10V boost converter by setting corresponding pex pin HIGH
+    claim_spi_bus();
     set_pex_pin(&pex2, PEX_A, BST_TEN_ENBL, 0);
+    release_spi_bus();
 }
 
 void enable_6V_boost(void) {
     // Enable 6V boost converter by setting corresponding pex pin HIGH
-    set_pex_pin(&pex2, PEX_B, BST_SIX_ENBL, 1);
+    // (bank B is shared with the heaters, see update_pex2_bank_b())
+    update_pex2_bank_b(_BV(BST_SIX_ENBL), _BV(BST_SIX_ENBL));
 }
 
 void disable_6V_boost(void) {
     // Disable 6V boost converter by setting corresponding pex pin HIGH
-    set_pex_pin(&pex2, PEX_B, BST_SIX_ENBL, 0);
+    // (bank B is shared with the heaters, see update_pex2_bank_b())
+    update_pex2_bank_b(_BV(BST_SIX_ENBL), 0);
 }
@@ -18,6 +18,25 @@ queue_t tx_msg_queue;
 // Set to true to print TX and RX CAN messages
 bool print_can_msgs = true;
 
+// Sequence number for the next TX message (byte 3), wraps around
+uint8_t tx_msg_seq = 0;
+// Incremented by the TX MOB callback, so must be volatile and read atomically
+volatile tx_msg_stats_t tx_msg_stats = { 0 };
+
+// Multi-frame response in progress (if any)
+tx_stream_t tx_stream = { .active = false };
+// Snapshot of the RAM region being sent by a RAM block read
+uint8_t ram_block_buf[RAM_BLOCK_MAX_LEN];
+// End (exclusive) of the EEPROM region being sent by an EEPROM block read
+uint16_t eeprom_block_end = 0;
+
+// Recent read results used to coalesce duplicate requests
+recent_resp_t recent_resps[RECENT_RESP_COUNT];
+// Index in recent_resps to overwrite next
+uint8_t next_recent_resp = 0;
+// 0 disables coalescing
+uint32_t coalesce_window_s = COALESCE_WINDOW_S_DEFAULT;
+
 
 void handle_hk(uint8_t field_num, uint8_t* tx_status, uint32_t* tx_data);
 void handle_opt(uint8_t field_num, uint8_t* tx_status);
@@ -26,6 +45,17 @@ void handle_ctrl(uint8_t field_num, uint32_t rx_data, uint8_t* tx_status,
 
 
 void process_next_rx_msg(void) {
+    // Finish sending a multi-frame response before processing the next
+    // command, so other responses don't get mixed in with its frames
+    if (tx_stream.active) {
+        fill_tx_stream();
+        // Don't wait forever if the TX queue stopped draining
+        if (tx_stream_timed_out(uptime_s)) {
+            abort_tx_stream();
+        }
+        return;
+    }
+
     // Get received message from queue
     uint8_t rx_msg[8] = { 0x00 };
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
@@ -53,10 +83,29 @@ void process_next_rx_msg(void) {
     uint8_t tx_status = CAN_STATUS_OK;
     uint32_t tx_data = 0;
 
+    // The data field is not used for OPT requests, so any two requests for the
+    // same well are identical
+    if (opcode == CAN_PAY_OPT) {
+        rx_data = 0;
+    }
+
+    // Serve a repeated read request from the result of an identical one that
+    // just finished, instead of doing the same (possibly slow) operation again
+    if (resp_coalescable(opcode, field_num) &&
+            find_recent_resp(opcode, field_num, rx_data, &tx_status, &tx_data)) {
+        enqueue_resp(opcode, field_num, tx_status, tx_data);
+        restart_com_timeout();
+        return;
+    }
+
     // Check message type
     switch (opcode) {
         case CAN_PAY_HK:
             handle_hk(field_num, &tx_status, &tx_data);
+            if (resp_coalescable(opcode, field_num)) {
+                save_recent_resp(opcode, field_num, rx_data, tx_status,
+                    tx_data);
+            }
             break;
         case CAN_PAY_OPT:
             handle_opt(field_num, &tx_status);
@@ -67,27 +116,157 @@ void process_next_rx_msg(void) {
             }
             break;
         case CAN_PAY_CTRL:
+            // Commands can change what HK/OPT would return, so don't use any
+            // results from before the command
+            clear_recent_resps();
             handle_ctrl(field_num, rx_data, &tx_status, &tx_data);
+            // If a multi-frame response was started, its frames are the
+            // response instead of a single message
+            if (tx_stream.active) {
+                fill_tx_stream();
+                restart_com_timeout();
+                return;
+            }
             break;
         default:
             tx_status = CAN_STATUS_INVALID_OPCODE;
             break;
     }
 
+    // Add message to transmit
+    enqueue_resp(opcode, field_num, tx_status, tx_data);
+
+    // Restart the timer for not receiving a command
+    restart_com_timeout();
+}
+
+
+// Builds a normal (single message) response and adds it to the TX queue
+void enqueue_resp(uint8_t opcode, uint8_t field_num, uint8_t tx_status,
+        uint32_t tx_data) {
     uint8_t tx_msg[8] = { 0x00 };
     tx_msg[0] = opcode;
     tx_msg[1] = field_num;
     tx_msg[2] = tx_status;
-    tx_msg[3] = 0x00;
+    tx_msg[3] = 0x00;   // sequence number, set when enqueued
     tx_msg[4] = (tx_data >> 24) & 0xFF;
     tx_msg[5] = (tx_data >> 16) & 0xFF;
     tx_msg[6] = (tx_data >> 8) & 0xFF;
     tx_msg[7] = tx_data & 0xFF;
-    // Add message to transmit
-    enqueue(&tx_msg_queue, tx_msg);
+    enqueue_tx_msg(tx_msg);
+}
 
-    // Restart the timer for not receiving a command
-    restart_com_timeout();
+
+/*
+Sets the sequence number (byte 3) of a generated TX message and adds it to the
+TX queue, updating the TX message counters. All TX messages should go through
+this instead of calling enqueue() directly.
+*/
+void enqueue_tx_msg(uint8_t* tx_msg) {
+    tx_msg[3] = tx_msg_seq;
+    tx_msg_seq += 1;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        tx_msg_stats.generated += 1;
+
+        if (queue_full(&tx_msg_queue)) {
+            tx_msg_stats.dropped += 1;
+        } else {
+            enqueue(&tx_msg_queue, tx_msg);
+            tx_msg_stats.enqueued += 1;
+        }
+    }
+}
+
+
+/*
+Returns true if a request can be served from a recent result. This is only the
+slow sensor reads (PAY-Optical and the SPI sensors/ADC channels). Counters,
+uptime and stored values are cheap to read and would be stale if repeated, so
+they are always read again.
+*/
+bool resp_coalescable(uint8_t opcode, uint8_t field_num) {
+    if (opcode == CAN_PAY_OPT) {
+        return true;
+    }
+    if (opcode != CAN_PAY_HK) {
+        return false;
+    }
+
+    switch (field_num) {
+        case CAN_PAY_HK_HUM:
+        case CAN_PAY_HK_PRES:
+        case CAN_PAY_HK_AMB_TEMP:
+        case CAN_PAY_HK_6V_TEMP:
+        case CAN_PAY_HK_10V_TEMP:
+        case CAN_PAY_HK_MOT1_TEMP:
+        case CAN_PAY_HK_MOT2_TEMP:
+        case CAN_PAY_HK_MF1_TEMP:
+        case CAN_PAY_HK_MF2_TEMP:
+        case CAN_PAY_HK_MF3_TEMP:
+        case CAN_PAY_HK_MF4_TEMP:
+        case CAN_PAY_HK_MF5_TEMP:
+        case CAN_PAY_HK_MF6_TEMP:
+        case CAN_PAY_HK_MF7_TEMP:
+        case CAN_PAY_HK_MF8_TEMP:
+        case CAN_PAY_HK_MF9_TEMP:
+        case CAN_PAY_HK_MF10_TEMP:
+        case CAN_PAY_HK_MF11_TEMP:
+        case CAN_PAY_HK_MF12_TEMP:
+        case CAN_PAY_HK_BAT_VOL:
+        case CAN_PAY_HK_6V_VOL:
+        case CAN_PAY_HK_6V_CUR:
+        case CAN_PAY_HK_10V_VOL:
+        case CAN_PAY_HK_10V_CUR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Remembers the result of a read request so identical requests within
+// coalesce_window_s can be served from it
+void save_recent_resp(uint8_t opcode, uint8_t field_num, uint32_t rx_data,
+        uint8_t tx_status, uint32_t tx_data) {
+    if (coalesce_window_s == 0) {
+        return;
+    }
+
+    recent_resp_t* resp = &recent_resps[next_recent_resp];
+    resp->valid = true;
+    resp->opcode = opcode;
+    resp->field_num = field_num;
+    resp->rx_data = rx_data;
+    resp->tx_status = tx_status;
+    resp->tx_data = tx_data;
+    resp->time_s = uptime_s;
+
+    next_recent_resp = (next_recent_resp + 1) % RECENT_RESP_COUNT;
+}
+
+// If there is a result for an identical request that is still fresh, sets
+// tx_status and tx_data from it and returns true
+bool find_recent_resp(uint8_t opcode, uint8_t field_num, uint32_t rx_data,
+        uint8_t* tx_status, uint32_t* tx_data) {
+    for (uint8_t i = 0; i < RECENT_RESP_COUNT; i++) {
+        recent_resp_t* resp = &recent_resps[i];
+        if (resp->valid &&
+                resp->opcode == opcode &&
+                resp->field_num == field_num &&
+                resp->rx_data == rx_data &&
+                (uptime_s - resp->time_s) < coalesce_window_s) {
+            *tx_status = resp->tx_status;
+            *tx_data = resp->tx_data;
+            return true;
+        }
+    }
+    return false;
+}
+
+void clear_recent_resps(void) {
+    for (uint8_t i = 0; i < RECENT_RESP_COUNT; i++) {
+        recent_resps[i].valid = false;
+    }
 }
 
 
@@ -115,74 +294,76 @@ void handle_hk(uint8_t field_num, uint8_t* tx_status, uint32_t* tx_data) {
     }
 
     else if (field_num == CAN_PAY_HK_AMB_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_GEN_THM);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_GEN_THM);
     }
 
     else if (field_num == CAN_PAY_HK_6V_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_BOOST6_TEMP);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_BOOST6_TEMP);
     }
 
     else if (field_num == CAN_PAY_HK_10V_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_BOOST10_TEMP);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_BOOST10_TEMP);
     }
 
     else if (field_num == CAN_PAY_HK_MOT1_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_MOTOR_TEMP_1);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_MOTOR_TEMP_1);
     }
 
     else if (field_num == CAN_PAY_HK_MOT2_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_MOTOR_TEMP_2);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_MOTOR_TEMP_2);
     }
 
     else if (field_num == CAN_PAY_HK_MF1_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF2_THM_6);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF2_THM_6);
     }
 
     else if (field_num == CAN_PAY_HK_MF2_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF2_THM_5);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF2_THM_5);
     }
 
     else if (field_num == CAN_PAY_HK_MF3_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF2_THM_4);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF2_THM_4);
     }
 
     else if (field_num == CAN_PAY_HK_MF4_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF2_THM_3);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF2_THM_3);
     }
 
     else if (field_num == CAN_PAY_HK_MF5_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF2_THM_2);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF2_THM_2);
     }
 
     else if (field_num == CAN_PAY_HK_MF6_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF2_THM_1);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF2_THM_1);
     }
 
     else if (field_num == CAN_PAY_HK_MF7_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF1_THM_6);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF1_THM_6);
     }
 
     else if (field_num == CAN_PAY_HK_MF8_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF1_THM_5);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF1_THM_5);
     }
 
     else if (field_num == CAN_PAY_HK_MF9_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF1_THM_4);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF1_THM_4);
     }
 
     else if (field_num == CAN_PAY_HK_MF10_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF1_THM_3);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF1_THM_3);
     }
 
     else if (field_num == CAN_PAY_HK_MF11_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF1_THM_2);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF1_THM_2);
     }
 
     else if (field_num == CAN_PAY_HK_MF12_TEMP) {
-        *tx_data = fetch_and_read_adc_channel(&adc2, ADC2_MF1_THM_1);
+        *tx_data = fetch_therm_adc_channel(ADC2_MF1_THM_1);
     }
 
     else if (field_num == CAN_PAY_HK_HEAT_SP) {
+        // Last setpoint set for all the zones at once - a zone's setpoint may
+        // have been changed since (see CAN_PAY_CTRL_GET_HEAT_ZONE_SP)
         *tx_data = heaters_setpoint_raw;
     }
 
@@ -191,31 +372,141 @@ void handle_hk(uint8_t field_num, uint8_t* tx_status, uint32_t* tx_data) {
     }
 
     else if (field_num == CAN_PAY_HK_THERM_EN) {
-        *tx_data = enables_to_uint(therm_enables, THERMISTOR_COUNT);
+        *tx_data = therm_enables;
     }
 
     else if (field_num == CAN_PAY_HK_HEAT_EN) {
-        *tx_data = enables_to_uint(heater_enables, HEATER_COUNT);
+        *tx_data = heater_enables;
     }
 
     else if (field_num == CAN_PAY_HK_BAT_VOL) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_BATT_VOLT_MON);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_BATT_VOLT_MON);
     }
 
     else if (field_num == CAN_PAY_HK_6V_VOL) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_BOOST6_VOLT_MON);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_BOOST6_VOLT_MON);
     }
 
     else if (field_num == CAN_PAY_HK_6V_CUR) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_BOOST6_CURR_MON);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_BOOST6_CURR_MON);
     }
 
     else if (field_num == CAN_PAY_HK_10V_VOL) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_BOOST10_VOLT_MON);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_BOOST10_VOLT_MON);
     }
 
     else if (field_num == CAN_PAY_HK_10V_CUR) {
-        *tx_data = fetch_and_read_adc_channel(&adc1, ADC1_BOOST10_CURR_MON);
+        *tx_data = fetch_spi_adc_channel(&adc1, ADC1_BOOST10_CURR_MON);
+    }
+
+    else if (field_num == CAN_PAY_HK_TX_GEN_COUNT) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = tx_msg_stats.generated;
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_TX_ENQ_COUNT) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = tx_msg_stats.enqueued;
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_TX_SENT_COUNT) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = tx_msg_stats.transmitted;
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_TX_DROP_COUNT) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = tx_msg_stats.dropped;
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_TX_STREAM_ABORTS) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = tx_msg_stats.stream_aborts;
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_CAN_RX_WINDOW) {
+        *tx_data = can_stats_rx_window();
+    }
+
+    else if (field_num == CAN_PAY_HK_CAN_TX_WINDOW) {
+        *tx_data = can_stats_tx_window();
+    }
+
+    else if (field_num == CAN_PAY_HK_CAN_ERR_COUNTERS) {
+        *tx_data = can_stats_err_counters();
+    }
+
+    else if (field_num == CAN_PAY_HK_CAN_ERR_FLAGS) {
+        *tx_data = can_stats_err_flags();
+    }
+
+    else if (field_num == CAN_PAY_HK_CAN_BUS_STATUS) {
+        // bits 31-16 = number of bus off events, bits 7-0 = status bits
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data =
+                ((uint32_t) can_stats.bus_off_count << 16) |
+                ((uint32_t) can_stats.status);
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_HEAT_CTRL_PERIOD) {
+        // Current heater control period in seconds
+        *tx_data = heater_ctrl_period_s;
+    }
+
+    else if (field_num >= CAN_PAY_HK_HEAT1_ON_TIME &&
+            field_num <= CAN_PAY_HK_HEAT5_ON_TIME) {
+        // Total seconds the heater has been ON
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = get_heater_on_time_s(
+                field_num - CAN_PAY_HK_HEAT1_ON_TIME, heater_enables, uptime_s);
+        }
+    }
+
+    else if (field_num >= CAN_PAY_HK_HEAT1_ENERGY &&
+            field_num <= CAN_PAY_HK_HEAT5_ENERGY) {
+        // Total energy the heater has used (J)
+        *tx_data = heater_energy_j[field_num - CAN_PAY_HK_HEAT1_ENERGY];
+    }
+
+    else if (field_num >= CAN_PAY_HK_HEAT1_SWITCHES &&
+            field_num <= CAN_PAY_HK_HEAT5_SWITCHES) {
+        // Number of times the heater has switched ON or OFF
+        *tx_data = heater_switch_count[field_num - CAN_PAY_HK_HEAT1_SWITCHES];
+    }
+
+    else if (field_num == CAN_PAY_HK_HEAT_SAFETY) {
+        // byte 3 = 1 if tripped, byte 2 = number of trips, byte 1 = ADC2
+        // channel of the last trip, byte 0 = number of samples skipped (up to
+        // 0xFF)
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            uint8_t skipped = heater_safety.skipped > 0xFF ?
+                0xFF : heater_safety.skipped;
+            *tx_data =
+                ((uint32_t) heater_safety.tripped << 24) |
+                ((uint32_t) heater_safety.trip_count << 16) |
+                ((uint32_t) heater_safety.trip_channel << 8) |
+                ((uint32_t) skipped);
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_HEAT_SAFETY_RAW) {
+        // ADC code of the last trip
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = heater_safety.trip_raw;
+        }
+    }
+
+    else if (field_num == CAN_PAY_HK_HEAT_SAFETY_TIME) {
+        // Uptime of the last trip
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            *tx_data = heater_safety.trip_time_s;
+        }
     }
 
     else {
@@ -231,9 +522,18 @@ void handle_opt(uint8_t field_num, uint8_t* tx_status) {
         return;
     }
 
+    // If a reading of the same well is already in progress, answer this
+    // request with its result when it finishes instead of starting over
+    if (spi_in_progress && current_well_info == field_num) {
+        if (opt_dup_req_count < 0xFF) {
+            opt_dup_req_count += 1;
+        }
+        return;
+    }
+
     // Get data from PAY-Optical over SPI
     // This will set the spi_in_progress flag
-    start_opt_spi_get_reading(field_num);    
+    start_opt_spi_get_reading(field_num);
 }
 
 
@@ -247,6 +547,21 @@ void handle_ctrl(uint8_t field_num, uint32_t rx_data, uint8_t* tx_status,
         *tx_data = read_eeprom((uint16_t) rx_data);
     }
 
+    else if (field_num == CAN_PAY_CTRL_READ_EEPROM_BLOCK) {
+        // bytes 3-2 = start address, bytes 1-0 = number of bytes
+        uint16_t addr = (rx_data >> 16) & 0xFFFF;
+        uint16_t len = rx_data & 0xFFFF;
+
+        if (len > 0 && len <= EEPROM_BLOCK_MAX_LEN &&
+                addr <= EEPROM_BLOCK_MAX_LEN - len) {
+            eeprom_block_end = addr + len;
+            start_tx_stream(CAN_PAY_CTRL, field_num, addr, len,
+                read_eeprom_block);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
     else if (field_num == CAN_PAY_CTRL_ERASE_EEPROM) {
         write_eeprom((uint16_t) rx_data, EEPROM_DEF_DWORD);
     }
@@ -263,6 +578,27 @@ void handle_ctrl(uint8_t field_num, uint32_t rx_data, uint8_t* tx_status,
         *tx_data = (uint32_t) (*pointer);
     }
 
+    else if (field_num == CAN_PAY_CTRL_READ_RAM_BLOCK) {
+        // bytes 3-2 = start address, bytes 1-0 = number of bytes
+        // Addresses are in the data space, so this covers registers, I/O
+        // registers and SRAM (same as CAN_PAY_CTRL_READ_RAM_BYTE)
+        uint16_t addr = (rx_data >> 16) & 0xFFFF;
+        uint16_t len = rx_data & 0xFFFF;
+
+        if (len > 0 && len <= RAM_BLOCK_MAX_LEN && addr <= RAMEND + 1 - len) {
+            copy_ram_block(addr, len);
+            start_tx_stream(CAN_PAY_CTRL, field_num, 0, len,
+                read_ram_block_buf);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_SET_COALESCE_WIN) {
+        // Window in seconds, 0 to disable
+        coalesce_window_s = rx_data;
+    }
+
     else if (field_num == CAN_PAY_CTRL_RESET_SSM) {
         reset_self_mcu(UPTIME_RESTART_REASON_RESET_CMD);
         // Note the program will stop here and restart
@@ -289,6 +625,7 @@ void handle_ctrl(uint8_t field_num, uint32_t rx_data, uint8_t* tx_status,
     }
 
     else if (field_num == CAN_PAY_CTRL_GET_HEAT_PARAMS) {
+        // Setpoint is the last one set for all the zones (as for HEAT_SP)
         *tx_data =
             ((uint32_t) heaters_setpoint_raw << 16) |
             ((uint32_t) invalid_therm_reading_raw);
@@ -302,6 +639,147 @@ void handle_ctrl(uint8_t field_num, uint32_t rx_data, uint8_t* tx_status,
         set_invalid_therm_reading_raw((uint16_t) rx_data);
     }
 
+    else if (field_num == CAN_PAY_CTRL_GET_HEAT_PID_GAIN) {
+        // rx_data = gain index (HEATER_PID_KP/KI/KD)
+        if (rx_data <= HEATER_PID_KD) {
+            *tx_data = get_heater_pid_gain((uint8_t) rx_data);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_SET_HEAT_PID_GAIN) {
+        uint8_t index = (rx_data >> 16) & 0xFF;   // byte 2
+        uint16_t gain = rx_data & 0xFFFF;         // bytes 1-0
+
+        // Also rejects gains above PID_GAIN_MAX, which could overflow the PID
+        // calculation
+        if (!set_heater_pid_gain(index, gain)) {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_GET_HEAT_CTRL_MODE) {
+        *tx_data = heater_ctrl_mode;
+    }
+
+    else if (field_num == CAN_PAY_CTRL_SET_HEAT_CTRL_MODE) {
+        if (rx_data == HEATER_CTRL_MODE_BANG_BANG ||
+                rx_data == HEATER_CTRL_MODE_PID) {
+            set_heater_ctrl_mode((uint8_t) rx_data);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_GET_THERM_HIST_INFO) {
+        // bytes 3-2 = number of bytes in the history, bytes 1-0 = number of
+        // records ever added
+        *tx_data =
+            ((uint32_t) therm_history.used << 16) |
+            ((uint32_t) therm_history.records);
+    }
+
+    else if (field_num == CAN_PAY_CTRL_READ_THERM_HIST) {
+        // Sends the whole history, oldest record first (a single response
+        // with data 0 if it is empty)
+        uint16_t len = start_therm_history_read(uptime_s);
+        if (len > 0) {
+            start_tx_stream(CAN_PAY_CTRL, field_num, 0, len,
+                read_therm_history);
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_READ_HEAT_CTRL_STATUS) {
+        // Sends heater_ctrl_status (see heaters.h for the layout)
+        copy_ram_block((uint16_t) &heater_ctrl_status, HEATER_CTRL_STATUS_LEN);
+        start_tx_stream(CAN_PAY_CTRL, field_num, 0, HEATER_CTRL_STATUS_LEN,
+            read_ram_block_buf);
+    }
+
+    else if (field_num == CAN_PAY_CTRL_GET_HEAT_MODEL) {
+        uint8_t heater = (rx_data >> 8) & 0xFF;    // byte 1 (0 to 4)
+        uint8_t index = rx_data & 0xFF;            // byte 0 (HEATER_MODEL_...)
+
+        if (heater < HEATER_COUNT && index <= HEATER_MODEL_UPDATES) {
+            *tx_data = get_heater_model_value(heater, index);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_RESET_HEAT_MODELS) {
+        reset_heater_models();
+    }
+
+    else if (field_num == CAN_PAY_CTRL_RESET_HEAT_STATS) {
+        reset_heater_stats(heater_enables, uptime_s);
+    }
+
+    else if (field_num == CAN_PAY_CTRL_CLEAR_HEAT_SAFETY_TRIP) {
+        clear_heater_safety_trip();
+    }
+
+    else if (field_num == CAN_PAY_CTRL_GET_HEAT_SWITCH_PARAM) {
+        // rx_data = parameter index (HEATER_SWITCH_...)
+        if (rx_data <= HEATER_SWITCH_MIN_OFF) {
+            *tx_data = get_heater_switch_param((uint8_t) rx_data);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_SET_HEAT_SWITCH_PARAM) {
+        uint8_t index = (rx_data >> 16) & 0xFF;   // byte 2
+        uint16_t value = rx_data & 0xFFFF;        // bytes 1-0
+
+        if (index <= HEATER_SWITCH_MIN_OFF) {
+            set_heater_switch_param(index, value);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_GET_HEAT_START_PARAM) {
+        // rx_data = parameter index (HEATER_START_...)
+        if (rx_data <= HEATER_START_CURR_BUDGET) {
+            *tx_data = get_heater_start_param((uint8_t) rx_data);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_SET_HEAT_START_PARAM) {
+        uint8_t index = (rx_data >> 16) & 0xFF;   // byte 2
+        uint16_t value = rx_data & 0xFFFF;        // bytes 1-0
+
+        if (index <= HEATER_START_CURR_BUDGET) {
+            set_heater_start_param(index, value);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_GET_HEAT_ZONE_SP) {
+        // rx_data = heater index (0 to 4)
+        if (rx_data < HEATER_COUNT) {
+            *tx_data = get_heater_zone_setpoint_raw((uint8_t) rx_data);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
+    else if (field_num == CAN_PAY_CTRL_SET_HEAT_ZONE_SP) {
+        uint8_t heater = (rx_data >> 16) & 0xFF;    // byte 2
+        uint16_t setpoint = rx_data & 0xFFFF;       // bytes 1-0
+
+        if (heater < HEATER_COUNT) {
+            set_heater_zone_setpoint_raw(heater, setpoint);
+        } else {
+            *tx_status = CAN_STATUS_INVALID_DATA;
+        }
+    }
+
     else if (field_num == CAN_PAY_CTRL_GET_THERM_READING) {
         if ((rx_data < THERMISTOR_COUNT) && (rx_data + 1 < THERMISTOR_COUNT)) {
             *tx_data =
@@ -336,11 +814,13 @@ void handle_ctrl(uint8_t field_num, uint32_t rx_data, uint8_t* tx_status,
     }
 
     else if (field_num == CAN_PAY_CTRL_GET_MOTOR_STATUS) {
+        claim_spi_bus();
         uint32_t fault1 = get_pex_pin(&pex1, PEX_B, MOT1_FLT_N) & 0x1;
         uint32_t fault2 = get_pex_pin(&pex1, PEX_A, MOT2_FLT_N) & 0x1;
 
         uint32_t switch1 = get_pex_pin(&pex2, PEX_A, LIM_SWT1_PRESSED) & 0x1;
         uint32_t switch2 = get_pex_pin(&pex2, PEX_A, LIM_SWT2_PRESSED) & 0x1;
+        release_spi_bus();
 
         uint32_t time = last_exec_time_motors & 0xFFFFF;
 
@@ -380,6 +860,110 @@ void handle_ctrl(uint8_t field_num, uint32_t rx_data, uint8_t* tx_status,
     }
 }
 
+/*
+Starts sending back len bytes starting at addr, 4 bytes per frame (the last
+frame is padded with whatever read_fn returns past the end). Each frame has the
+same format as a normal response, with the next 4 bytes in the data field.
+*/
+void start_tx_stream(uint8_t opcode, uint8_t field_num, uint16_t addr,
+        uint16_t len, uint32_t (*read_fn)(uint16_t addr)) {
+    tx_stream.opcode = opcode;
+    tx_stream.field_num = field_num;
+    tx_stream.addr = addr;
+    tx_stream.frames_left = (len + 3) / 4;
+    tx_stream.read_fn = read_fn;
+    tx_stream.last_frame_time_s = uptime_s;
+    tx_stream.active = true;
+}
+
+// Adds as many frames of the multi-frame response as will fit in the TX queue
+void fill_tx_stream(void) {
+    while (tx_stream.active && !queue_full(&tx_msg_queue)) {
+        uint32_t data = tx_stream.read_fn(tx_stream.addr);
+
+        uint8_t tx_msg[8] = { 0x00 };
+        tx_msg[0] = tx_stream.opcode;
+        tx_msg[1] = tx_stream.field_num;
+        tx_msg[2] = CAN_STATUS_OK;
+        tx_msg[3] = 0x00;
+        tx_msg[4] = (data >> 24) & 0xFF;
+        tx_msg[5] = (data >> 16) & 0xFF;
+        tx_msg[6] = (data >> 8) & 0xFF;
+        tx_msg[7] = data & 0xFF;
+        enqueue_tx_msg(tx_msg);
+        tx_stream.last_frame_time_s = uptime_s;
+
+        tx_stream.addr += 4;
+        tx_stream.frames_left -= 1;
+        if (tx_stream.frames_left == 0) {
+            tx_stream.active = false;
+        }
+    }
+}
+
+// Returns true if the multi-frame response hasn't had a frame queued for more
+// than TX_STREAM_TIMEOUT_S at uptime now_s
+bool tx_stream_timed_out(uint32_t now_s) {
+    return tx_stream.active &&
+        now_s - tx_stream.last_frame_time_s > TX_STREAM_TIMEOUT_S;
+}
+
+// Stops sending the multi-frame response (OBC sees it end early)
+void abort_tx_stream(void) {
+    tx_stream.active = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        tx_msg_stats.stream_aborts += 1;
+    }
+}
+
+/*
+Copies len bytes starting at addr into ram_block_buf. This is done atomically so
+the whole block is a consistent snapshot (e.g. a multi-byte variable or struct
+can't be updated by an interrupt partway through the copy).
+*/
+void copy_ram_block(uint16_t addr, uint16_t len) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint16_t i = 0; i < RAM_BLOCK_MAX_LEN; i++) {
+            if (i < len) {
+                // See CAN_PAY_CTRL_READ_RAM_BYTE for why this cast is needed
+                ram_block_buf[i] = *((volatile uint8_t*) (addr + i));
+            } else {
+                ram_block_buf[i] = 0x00;
+            }
+        }
+    }
+}
+
+// Returns the 4 bytes of ram_block_buf starting at offset (in the order they
+// appear in memory), or 0x00 for bytes past the end
+uint32_t read_ram_block_buf(uint16_t offset) {
+    uint32_t data = 0;
+    for (uint16_t i = offset; i < offset + 4; i++) {
+        data <<= 8;
+        if (i < RAM_BLOCK_MAX_LEN) {
+            data |= ram_block_buf[i];
+        }
+    }
+    return data;
+}
+
+/*
+Returns the 4 bytes of EEPROM starting at addr in the same order as
+read_eeprom() (the byte at addr is the least significant), or 0x00 for bytes
+past eeprom_block_end. Bytes past the end are never read, so a block that ends
+at E2END doesn't read outside the EEPROM.
+*/
+uint32_t read_eeprom_block(uint16_t addr) {
+    uint32_t data = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+        if (addr + i < eeprom_block_end) {
+            data |= (uint32_t) eeprom_read_byte(
+                (const uint8_t*) (addr + i)) << (8 * i);
+        }
+    }
+    return data;
+}
+
 /*
 If there is a TX message in the queue, sends it
 
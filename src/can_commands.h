@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <avr/eeprom.h>
+
 #include <adc/adc.h>
 #include <can/data_protocol.h>
 #include <uptime/uptime.h>
@@ -11,18 +13,160 @@
 
 #include "boost.h"
 #include "can_interface.h"
+#include "can_stats.h"
 #include "devices.h"
 #include "env_sensors.h"
 #include "heaters.h"
 #include "motors.h"
 #include "optical_spi.h"
 
+// PAY-specific HK field numbers that are not defined in lib-common's
+// data_protocol.h
+#define CAN_PAY_HK_TX_GEN_COUNT     0x40
+#define CAN_PAY_HK_TX_ENQ_COUNT     0x41
+#define CAN_PAY_HK_TX_SENT_COUNT    0x42
+#define CAN_PAY_HK_TX_DROP_COUNT    0x43
+#define CAN_PAY_HK_CAN_RX_WINDOW    0x44
+#define CAN_PAY_HK_CAN_TX_WINDOW    0x45
+#define CAN_PAY_HK_CAN_ERR_COUNTERS 0x46
+#define CAN_PAY_HK_CAN_ERR_FLAGS    0x47
+#define CAN_PAY_HK_CAN_BUS_STATUS   0x48
+#define CAN_PAY_HK_HEAT_CTRL_PERIOD 0x49
+// One field for each heater (heater 1 to 5), see heater_stats.c
+#define CAN_PAY_HK_HEAT1_ON_TIME    0x4A
+#define CAN_PAY_HK_HEAT5_ON_TIME    0x4E
+#define CAN_PAY_HK_HEAT1_ENERGY     0x4F
+#define CAN_PAY_HK_HEAT5_ENERGY     0x53
+#define CAN_PAY_HK_HEAT1_SWITCHES   0x54
+#define CAN_PAY_HK_HEAT5_SWITCHES   0x58
+#define CAN_PAY_HK_HEAT_SAFETY      0x59
+#define CAN_PAY_HK_HEAT_SAFETY_RAW  0x5A
+#define CAN_PAY_HK_HEAT_SAFETY_TIME 0x5B
+#define CAN_PAY_HK_TX_STREAM_ABORTS 0x5C
+
+// PAY-specific CTRL field numbers that are not defined in lib-common's
+// data_protocol.h
+#define CAN_PAY_CTRL_READ_EEPROM_BLOCK  0x40
+#define CAN_PAY_CTRL_READ_RAM_BLOCK     0x41
+#define CAN_PAY_CTRL_SET_COALESCE_WIN   0x42
+#define CAN_PAY_CTRL_GET_HEAT_PID_GAIN  0x43
+#define CAN_PAY_CTRL_SET_HEAT_PID_GAIN  0x44
+#define CAN_PAY_CTRL_GET_HEAT_CTRL_MODE 0x45
+#define CAN_PAY_CTRL_SET_HEAT_CTRL_MODE 0x46
+#define CAN_PAY_CTRL_GET_THERM_HIST_INFO    0x47
+#define CAN_PAY_CTRL_READ_THERM_HIST        0x48
+#define CAN_PAY_CTRL_READ_HEAT_CTRL_STATUS  0x49
+#define CAN_PAY_CTRL_GET_HEAT_MODEL         0x4A
+#define CAN_PAY_CTRL_RESET_HEAT_MODELS      0x4B
+#define CAN_PAY_CTRL_RESET_HEAT_STATS       0x4C
+#define CAN_PAY_CTRL_GET_HEAT_SWITCH_PARAM  0x4D
+#define CAN_PAY_CTRL_SET_HEAT_SWITCH_PARAM  0x4E
+#define CAN_PAY_CTRL_CLEAR_HEAT_SAFETY_TRIP 0x4F
+#define CAN_PAY_CTRL_GET_HEAT_ZONE_SP       0x50
+#define CAN_PAY_CTRL_SET_HEAT_ZONE_SP       0x51
+#define CAN_PAY_CTRL_GET_HEAT_START_PARAM   0x52
+#define CAN_PAY_CTRL_SET_HEAT_START_PARAM   0x53
+
+// Maximum number of bytes that can be requested in one EEPROM block read
+#define EEPROM_BLOCK_MAX_LEN    (E2END + 1)
+// Maximum number of bytes that can be requested in one RAM block read (this
+// much RAM is reserved to hold the copy while it is sent)
+#define RAM_BLOCK_MAX_LEN       72
+// A multi-frame response is abandoned if the TX queue doesn't take any of its
+// frames for more than this long (seconds, e.g. the bus is off), so commands
+// are processed again
+#define TX_STREAM_TIMEOUT_S     10
+
+/*
+Multi-frame response that is sent back one frame (4 data bytes) at a time as
+space becomes available in the TX queue
+*/
+typedef struct {
+    // true if there are frames left to send
+    bool active;
+    // Opcode and field number that every frame is sent with
+    uint8_t opcode;
+    uint8_t field_num;
+    // Address of the next 4 bytes to send
+    uint16_t addr;
+    // Number of frames left to send
+    uint16_t frames_left;
+    // Reads the 4 bytes to send starting at an address
+    uint32_t (*read_fn)(uint16_t addr);
+    // Uptime the last frame was added to the TX queue (or the start)
+    uint32_t last_frame_time_s;
+} tx_stream_t;
+
+/*
+Counts of TX messages at each stage, so OBC can tell where responses are lost.
+Each generated message also gets the next sequence number in byte 3, so gaps
+in the sequence show exactly which messages never made it.
+*/
+typedef struct {
+    // Built by PAY (every message that got a sequence number)
+    uint32_t generated;
+    // Added to the TX queue
+    uint32_t enqueued;
+    // Taken out of the TX queue by the TX MOB to be sent on the bus
+    uint32_t transmitted;
+    // Discarded because the TX queue was full
+    uint32_t dropped;
+    // Multi-frame responses abandoned before all their frames were queued
+    // (see TX_STREAM_TIMEOUT_S)
+    uint32_t stream_aborts;
+} tx_msg_stats_t;
+
+/*
+Result of a recent sensor read request (OPT or an HK sensor field, see
+resp_coalescable()), so an identical request that arrives shortly after (e.g.
+OBC retrying, or two ground tools polling the same field) can be answered
+without repeating the operation
+*/
+#define RECENT_RESP_COUNT           4
+// Default freshness window (in seconds) - 1 means only requests within the
+// same second of uptime are served from a recent result
+#define COALESCE_WINDOW_S_DEFAULT   1
+
+typedef struct {
+    bool valid;
+    uint8_t opcode;
+    uint8_t field_num;
+    uint32_t rx_data;
+    uint8_t tx_status;
+    uint32_t tx_data;
+    // uptime_s when the result was produced
+    uint32_t time_s;
+} recent_resp_t;
+
 extern queue_t rx_msg_queue;
 extern queue_t tx_msg_queue;
 
 extern bool print_can_msgs;
+extern tx_stream_t tx_stream;
+extern uint8_t tx_msg_seq;
+extern volatile tx_msg_stats_t tx_msg_stats;
+extern uint8_t ram_block_buf[];
+extern uint16_t eeprom_block_end;
+extern uint32_t coalesce_window_s;
 
 void process_next_rx_msg(void);
+void enqueue_tx_msg(uint8_t* tx_msg);
+void enqueue_resp(uint8_t opcode, uint8_t field_num, uint8_t tx_status,
+        uint32_t tx_data);
+bool resp_coalescable(uint8_t opcode, uint8_t field_num);
+void save_recent_resp(uint8_t opcode, uint8_t field_num, uint32_t rx_data,
+        uint8_t tx_status, uint32_t tx_data);
+bool find_recent_resp(uint8_t opcode, uint8_t field_num, uint32_t rx_data,
+        uint8_t* tx_status, uint32_t* tx_data);
+void clear_recent_resps(void);
 void send_next_tx_msg(void);
+void start_tx_stream(uint8_t opcode, uint8_t field_num, uint16_t addr,
+        uint16_t len, uint32_t (*read_fn)(uint16_t addr));
+void fill_tx_stream(void);
+bool tx_stream_timed_out(uint32_t now_s);
+void abort_tx_stream(void);
+void copy_ram_block(uint16_t addr, uint16_t len);
+uint32_t read_ram_block_buf(uint16_t offset);
+uint32_t read_eeprom_block(uint16_t addr);
 
 #endif
@@ -15,6 +15,8 @@ void cmd_rx_callback(const uint8_t* data, uint8_t len) {
         return;
     }
 
+    count_can_rx(len);
+
     // Add it to the queue of received messages to process
     enqueue(&rx_msg_queue, (uint8_t*) data);
 }
@@ -31,6 +33,8 @@ void data_tx_callback(uint8_t* data, uint8_t* len) {
         // If there is a message in the TX queue, transmit it
         dequeue(&tx_msg_queue, data);
         *len = 8;
+        tx_msg_stats.transmitted += 1;
+        count_can_tx(*len);
     }
 }
 
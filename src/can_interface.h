@@ -10,6 +10,7 @@
 #include <uart/uart.h>
 
 #include "can_commands.h"
+#include "can_stats.h"
 
 extern mob_t cmd_rx_mob;
 extern mob_t cmd_tx_mob;
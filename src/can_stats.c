@@ -0,0 +1,169 @@
+/*
+Instrumentation for the CAN controller, to correlate command latency problems
+with bus conditions.
+
+Frames and bytes are counted in each direction by the MOB callbacks (see
+can_interface.c), in 1 second buckets so rates can be read over a sliding
+window of the last CAN_STATS_WINDOW_S seconds. Once per second (uptime
+callback), the controller's error counters and general status/interrupt
+registers are sampled.
+
+The AVR CAN controller retries automatically after losing arbitration and does
+not flag it, so arbitration losses can't be counted directly. They show up as
+TX frames taking longer to go out (fewer TX frames per window than were
+enqueued, see tx_msg_stats).
+
+Reference: ATmega64M1 datasheet, CAN controller section
+*/
+
+#include "can_stats.h"
+
+
+volatile can_stats_t can_stats;
+
+
+void init_can_stats(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint8_t i = 0; i < CAN_STATS_WINDOW_S; i++) {
+            can_stats.rx_frames[i] = 0;
+            can_stats.rx_bytes[i] = 0;
+            can_stats.tx_frames[i] = 0;
+            can_stats.tx_bytes[i] = 0;
+        }
+        can_stats.cur_bucket = 0;
+
+        can_stats.tec = 0;
+        can_stats.rec = 0;
+        can_stats.max_tec = 0;
+        can_stats.max_rec = 0;
+        can_stats.status = 0;
+
+        can_stats.bus_off_count = 0;
+        can_stats.stuff_err_count = 0;
+        can_stats.crc_err_count = 0;
+        can_stats.form_err_count = 0;
+        can_stats.ack_err_count = 0;
+    }
+
+    add_uptime_callback(sample_can_stats);
+}
+
+void inc_sat(volatile uint8_t* count) {
+    if (*count < 0xFF) {
+        *count += 1;
+    }
+}
+
+// Called every second (by the uptime timer interrupt)
+void sample_can_stats(void) {
+    can_stats.tec = CANTEC;
+    can_stats.rec = CANREC;
+    if (can_stats.tec > can_stats.max_tec) {
+        can_stats.max_tec = can_stats.tec;
+    }
+    if (can_stats.rec > can_stats.max_rec) {
+        can_stats.max_rec = can_stats.rec;
+    }
+
+    uint8_t gsta = CANGSTA;
+    can_stats.status =
+        (((gsta >> ERRP) & 0x01) << CAN_STATS_STATUS_ERR_PASSIVE) |
+        (((gsta >> BOFF) & 0x01) << CAN_STATS_STATUS_BUS_OFF);
+
+    // Error flags in CANGIT stay set until they are cleared by writing 1
+    uint8_t flags = CANGIT & (_BV(BOFFIT) | _BV(SERG) | _BV(CERG) | _BV(FERG) |
+        _BV(AERG));
+    if (flags & _BV(BOFFIT)) {
+        can_stats.bus_off_count += 1;
+    }
+    if (flags & _BV(SERG)) {
+        inc_sat(&can_stats.stuff_err_count);
+    }
+    if (flags & _BV(CERG)) {
+        inc_sat(&can_stats.crc_err_count);
+    }
+    if (flags & _BV(FERG)) {
+        inc_sat(&can_stats.form_err_count);
+    }
+    if (flags & _BV(AERG)) {
+        inc_sat(&can_stats.ack_err_count);
+    }
+    CANGIT = flags;
+
+    // Start counting the next second
+    uint8_t next = (can_stats.cur_bucket + 1) % CAN_STATS_WINDOW_S;
+    can_stats.rx_frames[next] = 0;
+    can_stats.rx_bytes[next] = 0;
+    can_stats.tx_frames[next] = 0;
+    can_stats.tx_bytes[next] = 0;
+    can_stats.cur_bucket = next;
+}
+
+// Called by the RX MOB callback
+void count_can_rx(uint8_t len) {
+    can_stats.rx_frames[can_stats.cur_bucket] += 1;
+    can_stats.rx_bytes[can_stats.cur_bucket] += len;
+}
+
+// Called by the TX MOB callback
+void count_can_tx(uint8_t len) {
+    can_stats.tx_frames[can_stats.cur_bucket] += 1;
+    can_stats.tx_bytes[can_stats.cur_bucket] += len;
+}
+
+/*
+The following functions pack the statistics into 32-bit HK fields
+*/
+
+// bits 31-16 = RX frames in the window, bits 15-0 = RX bytes in the window
+uint32_t can_stats_rx_window(void) {
+    uint16_t frames = 0;
+    uint16_t bytes = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint8_t i = 0; i < CAN_STATS_WINDOW_S; i++) {
+            frames += can_stats.rx_frames[i];
+            bytes += can_stats.rx_bytes[i];
+        }
+    }
+    return ((uint32_t) frames << 16) | bytes;
+}
+
+// bits 31-16 = TX frames in the window, bits 15-0 = TX bytes in the window
+uint32_t can_stats_tx_window(void) {
+    uint16_t frames = 0;
+    uint16_t bytes = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint8_t i = 0; i < CAN_STATS_WINDOW_S; i++) {
+            frames += can_stats.tx_frames[i];
+            bytes += can_stats.tx_bytes[i];
+        }
+    }
+    return ((uint32_t) frames << 16) | bytes;
+}
+
+// byte 3 = TEC, byte 2 = REC, byte 1 = max TEC, byte 0 = max REC
+uint32_t can_stats_err_counters(void) {
+    uint32_t ret = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ret =
+            ((uint32_t) can_stats.tec << 24) |
+            ((uint32_t) can_stats.rec << 16) |
+            ((uint32_t) can_stats.max_tec << 8) |
+            ((uint32_t) can_stats.max_rec << 0);
+    }
+    return ret;
+}
+
+// byte 3 = stuff errors, byte 2 = CRC errors, byte 1 = form errors,
+// byte 0 = acknowledgment errors
+uint32_t can_stats_err_flags(void) {
+    uint32_t ret = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ret =
+            ((uint32_t) can_stats.stuff_err_count << 24) |
+            ((uint32_t) can_stats.crc_err_count << 16) |
+            ((uint32_t) can_stats.form_err_count << 8) |
+            ((uint32_t) can_stats.ack_err_count << 0);
+    }
+    return ret;
+}
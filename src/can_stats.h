@@ -0,0 +1,58 @@
+#ifndef CAN_STATS_H
+#define CAN_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include <uptime/uptime.h>
+
+// Number of 1 second buckets that frame/byte counts are summed over
+#define CAN_STATS_WINDOW_S  8
+
+// Bits of can_stats_t.status (sampled from CANGSTA)
+#define CAN_STATS_STATUS_ERR_PASSIVE    0
+#define CAN_STATS_STATUS_BUS_OFF        1
+
+typedef struct {
+    // Frames and bytes in each direction, for each of the last
+    // CAN_STATS_WINDOW_S seconds (index cur_bucket is the current second)
+    uint16_t rx_frames[CAN_STATS_WINDOW_S];
+    uint16_t rx_bytes[CAN_STATS_WINDOW_S];
+    uint16_t tx_frames[CAN_STATS_WINDOW_S];
+    uint16_t tx_bytes[CAN_STATS_WINDOW_S];
+    uint8_t cur_bucket;
+
+    // Transmit/receive error counters (CANTEC/CANREC) at the last sample
+    uint8_t tec;
+    uint8_t rec;
+    // Highest values of the error counters seen since reset
+    uint8_t max_tec;
+    uint8_t max_rec;
+    // Error passive/bus off state at the last sample
+    uint8_t status;
+
+    // Number of times the controller went bus off
+    uint16_t bus_off_count;
+    // Number of samples where each type of bus error was flagged (saturates
+    // at 0xFF)
+    uint8_t stuff_err_count;
+    uint8_t crc_err_count;
+    uint8_t form_err_count;
+    uint8_t ack_err_count;
+} can_stats_t;
+
+extern volatile can_stats_t can_stats;
+
+void init_can_stats(void);
+void sample_can_stats(void);
+void count_can_rx(uint8_t len);
+void count_can_tx(uint8_t len);
+uint32_t can_stats_rx_window(void);
+uint32_t can_stats_tx_window(void);
+uint32_t can_stats_err_counters(void);
+uint32_t can_stats_err_flags(void);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+Configuration parameters stored in EEPROM as one versioned, CRC-checked block.
+
+The whole block is read at once when PAY starts, instead of reading each
+parameter from its own address. There are two copies of the block, and each
+update is written to the copy that is not in use with the next sequence
+number. If power is lost partway through a write, that copy fails its CRC and
+the other (older but complete) copy is used, so the parameters are never a mix
+of old and new values. If neither copy is valid, all the parameters use their
+defaults together.
+
+Alternating between the two copies also replaces the wear levelling the heater
+stats used to do. Each save writes one copy, so the heater stats (the most
+frequent writer, every HEATER_STATS_SAVE_PERIOD_S = 30 min) write each copy once
+an hour. At the EEPROM's rated 100,000 write cycles that is about 100,000 hours
+(~11 years) of continuous operation, before counting the occasional save from a
+command. eeprom_update_block() skips the bytes that did not change, but the
+sequence number and CRC change on every save, so this is the limit.
+
+Each copy records how many bytes of config_data_t it was written with. To add a
+parameter, add it to the end of config_data_t and set it in
+set_default_config(). Copies written by older firmware are then shorter, so
+their values are still used for the parameters they have, and the new
+parameters use their defaults. CONFIG_VERSION only needs to increase if
+existing parameters are removed, moved or change meaning - copies with an
+older version are ignored, so everything (including the heater stats) goes
+back to its default.
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include <util/crc16.h>
+
+#include "config.h"
+#include "heaters.h"
+
+// Current values (modules should call save_config() after changing them)
+config_data_t config;
+// CONFIG_STATUS_...
+uint8_t config_status = CONFIG_STATUS_ERASED;
+// Copy with the current values in EEPROM (CONFIG_COPY_COUNT if neither)
+uint8_t config_copy = CONFIG_COPY_COUNT;
+uint16_t config_seq = 0;
+// init_config() only needs to load the block once
+bool config_loaded = false;
+
+
+/*
+Returns true if sequence number seq is newer than sequence number than, allowing
+for wraparound (newer if it is ahead by less than half the range).
+*/
+bool config_seq_newer(uint16_t seq, uint16_t than) {
+    return (int16_t) (seq - than) > 0;
+}
+
+void set_default_config(config_data_t* data) {
+    data->heaters_setpoint_raw = HEATERS_SETPOINT_RAW_DEFAULT;
+    data->invalid_therm_reading_raw = INVALID_THERM_READING_RAW_DEFAULT;
+    for (uint8_t i = 0; i < CONFIG_THERM_COUNT; i++) {
+        data->therm_err_codes[i] = THERM_ERR_CODE_NORMAL;
+    }
+    data->heater_ctrl_mode = HEATER_CTRL_MODE_DEFAULT;
+    data->heater_pid_gains.kp = PID_KP_DEFAULT;
+    data->heater_pid_gains.ki = PID_KI_DEFAULT;
+    data->heater_pid_gains.kd = PID_KD_DEFAULT;
+    data->heater_hyst_band_centi = HEATER_HYST_BAND_CENTI_DEFAULT;
+    data->heater_min_on_s = HEATER_MIN_ON_S_DEFAULT;
+    data->heater_min_off_s = HEATER_MIN_OFF_S_DEFAULT;
+    for (uint8_t i = 0; i < CONFIG_HEATER_COUNT; i++) {
+        data->heater_on_time_s[i] = 0;
+        data->heater_energy_j[i] = 0;
+        data->heater_switch_count[i] = 0;
+        data->heater_zone_setpoints_raw[i] = HEATERS_SETPOINT_RAW_DEFAULT;
+    }
+    data->heater_start_spacing_s = HEATER_START_SPACING_S;
+    data->heater_max_active = HEATER_MAX_ACTIVE_DEFAULT;
+    data->heater_boost6_curr_budget_ma = HEATER_BOOST6_CURR_BUDGET_MA;
+}
+
+uint16_t calc_config_crc(const config_block_t* block) {
+    const uint8_t* bytes = (const uint8_t*) block;
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < offsetof(config_block_t, crc); i++) {
+        crc = _crc_ccitt_update(crc, bytes[i]);
+    }
+
+    const uint8_t* data = (const uint8_t*) &block->data;
+    for (uint8_t i = 0; i < block->len && i < sizeof(config_data_t); i++) {
+        crc = _crc_ccitt_update(crc, data[i]);
+    }
+    return crc;
+}
+
+// Returns true if the copy can be used (it may be shorter than config_data_t)
+bool config_block_valid(const config_block_t* block) {
+    return block->version == CONFIG_VERSION &&
+        block->len <= sizeof(config_data_t) &&
+        block->crc == calc_config_crc(block);
+}
+
+// Reads one copy of the block from EEPROM
+void read_config_block(uint8_t copy, config_block_t* block) {
+    eeprom_read_block(block,
+        (const void*) (CONFIG_EEPROM_ADDR + (copy * CONFIG_COPY_LEN)),
+        sizeof(config_block_t));
+}
+
+// Returns true if the block is still erased (all 0xFF)
+bool config_block_erased(const config_block_t* block) {
+    const uint8_t* bytes = (const uint8_t*) block;
+    for (uint8_t i = 0; i < sizeof(config_block_t); i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+Loads config from the newest valid copy in EEPROM, or the defaults if there
+isn't one (see config_status). Parameters that are past the end of the copy
+use their defaults. Only loads it the first time it is called, so every module
+that uses config can call it in its init function.
+*/
+void init_config(void) {
+    if (config_loaded) {
+        return;
+    }
+    config_loaded = true;
+
+    config_copy = CONFIG_COPY_COUNT;
+    bool erased = true;
+    config_block_t block;
+
+    for (uint8_t i = 0; i < CONFIG_COPY_COUNT; i++) {
+        read_config_block(i, &block);
+        if (!config_block_erased(&block)) {
+            erased = false;
+        }
+
+        if (!config_block_valid(&block)) {
+            continue;
+        }
+        if (config_copy == CONFIG_COPY_COUNT ||
+                config_seq_newer(block.seq, config_seq)) {
+            set_default_config(&config);
+            memcpy(&config, &block.data, block.len);
+            config_copy = i;
+            config_seq = block.seq;
+        }
+    }
+
+    if (config_copy < CONFIG_COPY_COUNT) {
+        config_status = CONFIG_STATUS_OK;
+    } else {
+        set_default_config(&config);
+        config_status = erased ? CONFIG_STATUS_ERASED : CONFIG_STATUS_INVALID;
+    }
+}
+
+/*
+Writes config to the copy that is not in use, if it is different from the
+current copy in EEPROM. Returns true if it was written.
+*/
+bool save_config(void) {
+    config_block_t block;
+
+    if (config_copy < CONFIG_COPY_COUNT) {
+        read_config_block(config_copy, &block);
+        if (block.len == sizeof(config_data_t) &&
+                memcmp(&block.data, &config, sizeof(config_data_t)) == 0) {
+            return false;
+        }
+    }
+
+    uint8_t copy = (config_copy + 1) % CONFIG_COPY_COUNT;
+    if (config_copy == CONFIG_COPY_COUNT) {
+        copy = 0;
+    }
+    uint16_t seq = config_seq + 1;
+    if (seq == CONFIG_SEQ_ERASED) {
+        seq = 0;
+    }
+
+    block.version = CONFIG_VERSION;
+    block.len = sizeof(config_data_t);
+    block.seq = seq;
+    block.data = config;
+    block.crc = calc_config_crc(&block);
+    eeprom_update_block(&block,
+        (void*) (CONFIG_EEPROM_ADDR + (copy * CONFIG_COPY_LEN)),
+        sizeof(config_block_t));
+
+    config_copy = copy;
+    config_seq = seq;
+    config_status = CONFIG_STATUS_OK;
+    return true;
+}
@@ -0,0 +1,93 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/eeprom.h>
+
+#include <utilities/utilities.h>
+
+#include "heater_pid.h"
+
+// Increase only if existing fields of config_data_t are removed, moved or
+// change meaning (older blocks are then replaced with the defaults) - new
+// fields are added at the end instead (see config.c)
+#define CONFIG_VERSION          5
+// The two copies of the configuration block
+#define CONFIG_EEPROM_ADDR      0x400
+#define CONFIG_COPY_COUNT       2
+// EEPROM space reserved for each copy (must be at least sizeof(config_block_t))
+#define CONFIG_COPY_LEN         128
+
+// Number of thermistors (same as THERMISTOR_COUNT) and heaters (same as
+// HEATER_COUNT)
+#define CONFIG_THERM_COUNT      12
+#define CONFIG_HEATER_COUNT     5
+
+// Sequence number that is never written, so an erased copy can't be mistaken
+// for the newest one
+#define CONFIG_SEQ_ERASED       0xFFFF
+
+// Result of loading the configuration (config_status)
+// Loaded from a valid copy
+#define CONFIG_STATUS_OK        0
+// Never written, using the defaults
+#define CONFIG_STATUS_ERASED    1
+// No copy with a valid version and CRC, using the defaults
+#define CONFIG_STATUS_INVALID   2
+
+// Parameters that are kept through resets (only add new ones at the end)
+typedef struct {
+    // heaters.c
+    uint16_t heaters_setpoint_raw;
+    uint16_t invalid_therm_reading_raw;
+    uint8_t therm_err_codes[CONFIG_THERM_COUNT];
+    uint8_t heater_ctrl_mode;
+    pid_gains_t heater_pid_gains;
+    uint16_t heater_hyst_band_centi;
+    uint16_t heater_min_on_s;
+    uint16_t heater_min_off_s;
+    uint16_t heater_zone_setpoints_raw[CONFIG_HEATER_COUNT];
+
+    // heater_stats.c
+    uint32_t heater_on_time_s[CONFIG_HEATER_COUNT];
+    uint32_t heater_energy_j[CONFIG_HEATER_COUNT];
+    uint32_t heater_switch_count[CONFIG_HEATER_COUNT];
+
+    // heaters.c
+    uint16_t heater_start_spacing_s;
+    uint8_t heater_max_active;
+    uint16_t heater_boost6_curr_budget_ma;
+} config_data_t;
+
+// One copy of the configuration in EEPROM
+typedef struct {
+    uint8_t version;
+    // Number of bytes of data that were written (sizeof(config_data_t) in the
+    // firmware that wrote it)
+    uint8_t len;
+    // Sequence number - the valid copy with the newest one is used
+    uint16_t seq;
+    // CRC-CCITT of the fields above and the first len bytes of data
+    uint16_t crc;
+    config_data_t data;
+} config_block_t;
+
+_Static_assert(sizeof(config_block_t) <= CONFIG_COPY_LEN,
+    "config_block_t must fit in CONFIG_COPY_LEN");
+
+extern config_data_t config;
+extern uint8_t config_status;
+extern uint8_t config_copy;
+extern uint16_t config_seq;
+extern bool config_loaded;
+
+bool config_seq_newer(uint16_t seq, uint16_t than);
+void init_config(void);
+void set_default_config(config_data_t* data);
+uint16_t calc_config_crc(const config_block_t* block);
+bool config_block_valid(const config_block_t* block);
+bool save_config(void);
+
+#endif
@@ -51,3 +51,52 @@ pex_t pex2 = {
     .cs = &pex_cs,
     .rst = &pex_rst
 };
+
+// Number of SPI transfers in progress outside of interrupts (see
+// claim_spi_bus())
+volatile uint8_t spi_bus_claims = 0;
+
+
+/*
+The over-temperature monitor uses the SPI bus from a timer interrupt (see
+heater_safety.c), and the SPI peripheral has no lock of its own. Every other
+SPI transfer, from its first frame to its last (e.g. selecting an ADC channel
+and reading it, or a sensor command and reading the result), must be between
+claim_spi_bus() and release_spi_bus(). The monitor skips its sample while the
+bus is claimed. Claims can be nested.
+
+This isn't needed before the monitor is started (init_heater_safety()).
+*/
+void claim_spi_bus(void) {
+    spi_bus_claims += 1;
+}
+
+void release_spi_bus(void) {
+    if (spi_bus_claims > 0) {
+        spi_bus_claims -= 1;
+    }
+}
+
+// Fetches and reads one ADC channel with the SPI bus claimed
+uint16_t fetch_spi_adc_channel(adc_t* adc, uint8_t channel) {
+    claim_spi_bus();
+    uint16_t raw = fetch_and_read_adc_channel(adc, channel);
+    release_spi_bus();
+    return raw;
+}
+
+/*
+Sets the PEX2 bank B pins in mask to the values in bits, leaving the other pins
+unchanged. Bank B has both the heater enables and the 6V boost enable, and the
+heaters can be turned OFF from a timer interrupt (see heater_safety.c), so all
+writes to it go through here. The bus is claimed for the whole read-modify-write,
+so a write that started before the interrupt can't put back the old heater
+state.
+*/
+void update_pex2_bank_b(uint8_t mask, uint8_t bits) {
+    claim_spi_bus();
+    uint8_t bank = read_pex_register(&pex2, PEX_GPIO_BASE + PEX_B);
+    bank = (bank & ~mask) | (bits & mask);
+    write_pex_register(&pex2, PEX_GPIO_BASE + PEX_B, bank);
+    release_spi_bus();
+}
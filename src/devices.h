@@ -73,5 +73,11 @@ extern adc_t adc2;
 extern pex_t pex1;
 extern pex_t pex2;
 
+extern volatile uint8_t spi_bus_claims;
+
+void claim_spi_bus(void);
+void release_spi_bus(void);
+uint16_t fetch_spi_adc_channel(adc_t* adc, uint8_t channel);
+void update_pex2_bank_b(uint8_t mask, uint8_t bits);
 
 #endif
@@ -29,6 +29,7 @@ The data received over SPI is formatted as
 uint16_t read_hum_raw_data(void) {
     uint32_t data = 0;
 
+    claim_spi_bus();
     set_cs_low(HUM_CS_PIN, &HUM_CS_PORT);
     data |= send_spi(0x00);
     data <<= 8;
@@ -38,6 +39,7 @@ uint16_t read_hum_raw_data(void) {
     data <<= 8;
     data |= send_spi(0x00);
     set_cs_high(HUM_CS_PIN, &HUM_CS_PORT);
+    release_spi_bus();
 
     // Isolate the 14 bits for humidity
     return (data >> 16) & 0x3FFF;
@@ -66,11 +68,13 @@ void init_pres(void) {
 Resets the pressure sensor.
 */
 void reset_pres(void) {
+    claim_spi_bus();
     set_cs_low(PRES_CS_PIN, &PRES_CS_PORT);
     send_spi(PRES_CMD_RESET);
     // 2.8ms reload time (p.10)
     _delay_ms(3);
     set_cs_high(PRES_CS_PIN, &PRES_CS_PORT);
+    release_spi_bus();
 }
 
 
@@ -81,12 +85,14 @@ p.8,11
 uint16_t read_pres_prom(uint8_t address) {
     uint16_t data = 0;
 
+    claim_spi_bus();
     set_cs_low(PRES_CS_PIN, &PRES_CS_PORT);
     send_spi((address << 1) | PRES_CMD_PROM_READ_BASE);
     data |= (uint16_t) send_spi(0x00);
     data <<= 8;
     data |= (uint16_t) send_spi(0x00);
     set_cs_high(PRES_CS_PIN, &PRES_CS_PORT);
+    release_spi_bus();
 
     return data;
 }
@@ -97,6 +103,8 @@ Reads 24 bits of raw uncompensated pressure or temperature data from the
 pressure sensor's ADC, depending on the command given.
 */
 uint32_t read_pres_raw_uncomp_data(uint8_t cmd) {
+    // Claimed from the command to the end of the read
+    claim_spi_bus();
     set_cs_low(PRES_CS_PIN, &PRES_CS_PORT);
     send_spi(cmd);
     // wait for adc conversion to complete
@@ -114,6 +122,7 @@ uint32_t read_pres_raw_uncomp_data(uint8_t cmd) {
     data <<= 8;
     data |= (uint32_t) send_spi(0x00);
     set_cs_high(PRES_CS_PIN, &PRES_CS_PORT);
+    release_spi_bus();
 
     return data;
 }
@@ -8,6 +8,8 @@
 #include <spi/spi.h>
 #include <uart/uart.h>
 
+#include "devices.h"
+
 /* Humidity Sensor */
 
 #define HUM_CS_PIN  PD0
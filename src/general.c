@@ -47,4 +47,8 @@ void init_pay(void) {
 
     init_uptime();
     init_com_timeout();
+    init_can_stats();
+
+    // Over-temperature monitor (needs uptime and the heater thresholds)
+    init_heater_safety();
 }
@@ -23,6 +23,7 @@
 // PAY libraries
 #include "can_commands.h"
 #include "can_interface.h"
+#include "can_stats.h"
 #include "devices.h"
 #include "env_sensors.h"
 #include "motors.h"
@@ -0,0 +1,100 @@
+/*
+Integer PID controller for the heater duty cycles (see heaters.c).
+
+The derivative term uses the change in the input instead of the change in the
+error, so changing the setpoint doesn't cause a spike in the output.
+
+Anti-windup:
+- The integral term is clamped to the output range
+- The integral term stops accumulating in the direction the output is already
+  saturated in
+
+The output can only change by rate_max percent per call, so the heaters don't
+jump between fully on and fully off between control periods.
+*/
+
+#include "heater_pid.h"
+
+// Clamps a fixed point output to [0, PID_OUT_MAX_FIXED]
+int32_t clamp_pid_out(int32_t out) {
+    if (out < 0) {
+        return 0;
+    }
+    if (out > PID_OUT_MAX_FIXED) {
+        return PID_OUT_MAX_FIXED;
+    }
+    return out;
+}
+
+// Limits a P or D term to a few times the output range (past that the output
+// is saturated anyway), so adding the terms can't overflow
+int32_t clamp_pid_term(int32_t term) {
+    if (term < -PID_TERM_MAX_FIXED) {
+        return -PID_TERM_MAX_FIXED;
+    }
+    if (term > PID_TERM_MAX_FIXED) {
+        return PID_TERM_MAX_FIXED;
+    }
+    return term;
+}
+
+void reset_pid(pid_state_t* pid) {
+    pid->integral = 0;
+    pid->prev_input = 0;
+    pid->output = 0;
+    pid->primed = false;
+}
+
+/*
+Runs one step of the controller and returns the new output (0 to PID_OUT_MAX).
+setpoint, input - in centi-degrees C
+dt_s - time since the last step (seconds)
+rate_max - maximum change in the output from the last step (0 for no limit)
+*/
+uint8_t run_pid(pid_state_t* pid, const pid_gains_t* gains, int16_t setpoint,
+        int16_t input, uint16_t dt_s, uint8_t rate_max) {
+    if (dt_s > PID_DT_MAX_S) {
+        dt_s = PID_DT_MAX_S;
+    }
+
+    // The products fit in 32 bits since the gains are at most PID_GAIN_MAX and
+    // the error and change in the input are at most PID_ERR_MAX
+    int32_t err = (int32_t) setpoint - input;
+    int32_t p = clamp_pid_term((int32_t) gains->kp * err);
+
+    int32_t d = 0;
+    if (pid->primed && dt_s > 0) {
+        int32_t change = (int32_t) input - pid->prev_input;
+        d = clamp_pid_term(-((int32_t) gains->kd * change) / dt_s);
+    }
+
+    // Don't integrate further into saturation
+    int32_t out = p + pid->integral + d;
+    bool saturated_high = (out >= PID_OUT_MAX_FIXED) && (err > 0);
+    bool saturated_low = (out <= 0) && (err < 0);
+    if (!saturated_high && !saturated_low) {
+        // Clamp before multiplying by dt so it can't overflow
+        int32_t rate = clamp_pid_out((int32_t) gains->ki * (err < 0 ? -err : err));
+        int32_t step = rate * dt_s;
+        pid->integral = clamp_pid_out(
+            err < 0 ? pid->integral - step : pid->integral + step);
+    }
+
+    out = clamp_pid_out(p + pid->integral + d);
+    // Round to the nearest percent
+    int16_t output = (int16_t) ((out + (1L << (PID_FRAC_BITS - 1))) >> PID_FRAC_BITS);
+
+    if (pid->primed && rate_max > 0) {
+        if (output > pid->output + rate_max) {
+            output = pid->output + rate_max;
+        } else if (output < pid->output - rate_max) {
+            output = pid->output - rate_max;
+        }
+    }
+
+    pid->output = (uint8_t) output;
+    pid->prev_input = input;
+    pid->primed = true;
+
+    return pid->output;
+}
@@ -0,0 +1,61 @@
+#ifndef HEATER_PID_H
+#define HEATER_PID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Gains and the integral term are fixed point, with this many fractional bits
+#define PID_FRAC_BITS       16
+// Maximum output (duty cycle in percent, same as HEATER_DUTY_MAX)
+#define PID_OUT_MAX         100
+// Maximum output in fixed point
+#define PID_OUT_MAX_FIXED   ((int32_t) PID_OUT_MAX << PID_FRAC_BITS)
+// Limit for the P and D terms in fixed point
+#define PID_TERM_MAX_FIXED  (8 * PID_OUT_MAX_FIXED)
+// Longer time steps are treated as this long so the integral can't overflow
+#define PID_DT_MAX_S        300
+// Largest error (or change in the input) - the difference of two int16 values
+#define PID_ERR_MAX         ((int32_t) UINT16_MAX)
+// Largest gain that can be multiplied by PID_ERR_MAX without overflowing 32 bits
+#define PID_GAIN_MAX        (INT32_MAX / PID_ERR_MAX)
+
+/*
+Gains (all fixed point with PID_FRAC_BITS fractional bits), where the error is
+in centi-degrees C and the output is duty cycle in percent:
+kp - percent per centi-degree
+ki - percent per centi-degree per second
+kd - percent per centi-degree per second of change
+Each gain must be at most PID_GAIN_MAX.
+*/
+typedef struct {
+    uint16_t kp;
+    uint16_t ki;
+    uint16_t kd;
+} pid_gains_t;
+
+// Defaults - full duty at 3 C below the setpoint (kp), ~10% more duty after
+// 1 C below the setpoint for 10 minutes (ki), no derivative term (kd)
+#define PID_KP_DEFAULT      21845
+#define PID_KI_DEFAULT      11
+#define PID_KD_DEFAULT      0
+
+_Static_assert(PID_KP_DEFAULT <= PID_GAIN_MAX && PID_KI_DEFAULT <= PID_GAIN_MAX &&
+    PID_KD_DEFAULT <= PID_GAIN_MAX, "default PID gains must be at most PID_GAIN_MAX");
+
+// State for one controller
+typedef struct {
+    // Accumulated integral term (output in fixed point)
+    int32_t integral;
+    // Last input, for the derivative term
+    int16_t prev_input;
+    // Last output (rate limited)
+    uint8_t output;
+    // false until there is a previous input
+    bool primed;
+} pid_state_t;
+
+void reset_pid(pid_state_t* pid);
+uint8_t run_pid(pid_state_t* pid, const pid_gains_t* gains, int16_t setpoint,
+    int16_t input, uint16_t dt_s, uint8_t rate_max);
+
+#endif
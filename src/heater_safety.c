@@ -0,0 +1,146 @@
+/*
+Over-temperature cutoff that doesn't depend on the main loop.
+
+The heater control only looks at the thermistors once per control period (up
+to a few minutes), and not at all while the main loop is blocked (e.g. running
+the motors or waiting for PAY-Optical). If a heater is stuck ON, the MF chips
+could overheat in that time.
+
+This monitor runs from the 8-bit timer interrupt every HEATER_SAFETY_PERIOD_S.
+It reads a few thermistor channels (heater_safety_channels) and compares the
+raw ADC codes with an integer limit. If any of them is above the limit for
+HEATER_SAFETY_TRIP_COUNT samples in a row, it turns all the heaters OFF with
+a single PEX write and latches the trip. While tripped, the heaters are held
+OFF (see set_heaters()) until ground clears the trip. It also turns the
+heaters OFF if the main loop stops switching them (see check_heater_pwm_stall()).
+
+The ADC and PEX share the SPI bus with the main loop, so a sample is skipped
+if the main loop has claimed the bus (see claim_spi_bus()), which it does for
+the whole of every transfer, including the steps of multi-frame sequences such
+as selecting an ADC channel and reading it. As a second check, a sample is also
+skipped if any chip select is low.
+
+The monitor uses the 8-bit timer (lib-common's timer.c), so nothing else can
+use that timer while it runs. Uptime uses the 16-bit timer.
+*/
+
+#include "heater_safety.h"
+#include "env_sensors.h"
+#include "heaters.h"
+#include "optical_spi.h"
+
+volatile heater_safety_t heater_safety = {
+    .tripped = false,
+    .over_count = 0,
+    .trip_count = 0,
+    .trip_channel = 0,
+    .trip_raw = 0,
+    .trip_time_s = 0,
+    .skipped = 0
+};
+
+// Raw ADC code for HEATER_SAFETY_LIMIT_CENTI
+uint16_t heater_safety_limit_raw = 0x0FFF;
+
+// Thermistors monitored (ADC2 channels), spread over both MF chips
+const uint8_t heater_safety_channels[HEATER_SAFETY_CHANNEL_COUNT] = {
+    ADC2_MF1_THM_1,
+    ADC2_MF1_THM_4,
+    ADC2_MF2_THM_1,
+    ADC2_MF2_THM_4
+};
+
+
+/*
+Starts the monitor on the 8-bit timer. Call this after init_uptime() (the trip
+time and the PWM stall check use uptime_s) and init_heater_ctrl() (the limit
+uses therm_uhl_raw from update_heater_thresholds()).
+*/
+void init_heater_safety(void) {
+    heater_safety_limit_raw = therm_centi_to_adc_raw(HEATER_SAFETY_LIMIT_CENTI);
+    start_timer_8bit(HEATER_SAFETY_PERIOD_S, run_heater_safety);
+}
+
+// Reads one ADC2 (thermistor) channel from the main loop
+uint16_t fetch_therm_adc_channel(uint8_t channel) {
+    return fetch_spi_adc_channel(&adc2, channel);
+}
+
+// Returns true if the bus isn't claimed and no SPI chip select is low
+bool heater_safety_spi_idle(void) {
+    return spi_bus_claims == 0 &&
+        (ADC1_CS_PORT & _BV(ADC1_CS_PIN)) &&
+        (ADC2_CS_PORT & _BV(ADC2_CS_PIN)) &&
+        (PEX_CS_PORT & _BV(PEX_CS_PIN)) &&
+        (OPT_CS_PORT & _BV(OPT_CS)) &&
+        (HUM_CS_PORT & _BV(HUM_CS_PIN)) &&
+        (PRES_CS_PORT & _BV(PRES_CS_PIN));
+}
+
+/*
+Returns true if a reading is over the limit. Readings above the thermistor
+range (therm_uhl_raw) are a failed thermistor rather than a real temperature,
+and are left to the normal control loop to eliminate.
+*/
+bool check_heater_safety_sample(uint16_t raw) {
+    return raw >= heater_safety_limit_raw && raw <= therm_uhl_raw;
+}
+
+// Turns all the heaters OFF and records the trip
+void trip_heater_safety(uint8_t channel, uint16_t raw) {
+    heater_safety.tripped = true;
+    heater_safety.trip_channel = channel;
+    heater_safety.trip_raw = raw;
+    heater_safety.trip_time_s = uptime_s;
+    if (heater_safety.trip_count < 0xFF) {
+        heater_safety.trip_count += 1;
+    }
+
+    set_heaters(0);
+}
+
+// Timer callback (runs in the interrupt)
+void run_heater_safety(void) {
+    // Already OFF, and kept OFF by the main loop
+    if (heater_safety.tripped) {
+        return;
+    }
+    if (!heater_safety_spi_idle()) {
+        heater_safety.skipped += 1;
+        return;
+    }
+
+    // Also limits how long a blocked main loop can keep a heater ON
+    check_heater_pwm_stall();
+
+    bool over = false;
+    uint8_t over_channel = 0;
+    uint16_t over_raw = 0;
+    for (uint8_t i = 0; i < HEATER_SAFETY_CHANNEL_COUNT; i++) {
+        uint8_t channel = heater_safety_channels[i];
+        uint16_t raw = fetch_and_read_adc_channel(&adc2, channel);
+        if (check_heater_safety_sample(raw) && raw >= over_raw) {
+            over = true;
+            over_channel = channel;
+            over_raw = raw;
+        }
+    }
+
+    if (!over) {
+        heater_safety.over_count = 0;
+        return;
+    }
+
+    heater_safety.over_count += 1;
+    if (heater_safety.over_count >= HEATER_SAFETY_TRIP_COUNT) {
+        trip_heater_safety(over_channel, over_raw);
+    }
+}
+
+// Lets the heaters turn ON again (by ground command)
+void clear_heater_safety_trip(void) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        heater_safety.tripped = false;
+        heater_safety.over_count = 0;
+    }
+}
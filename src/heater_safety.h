@@ -0,0 +1,53 @@
+#ifndef HEATER_SAFETY_H
+#define HEATER_SAFETY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <adc/adc.h>
+#include <timer/timer.h>
+#include <uptime/uptime.h>
+#include <util/atomic.h>
+
+#include "devices.h"
+
+// How often the monitor samples the thermistors (seconds, run by the 8-bit
+// timer)
+#define HEATER_SAFETY_PERIOD_S      1
+// Hard limit (centi-degrees C) - all the heaters are turned OFF if a monitored
+// thermistor is above this for HEATER_SAFETY_TRIP_COUNT samples in a row
+#define HEATER_SAFETY_LIMIT_CENTI   5000
+#define HEATER_SAFETY_TRIP_COUNT    2
+// Number of thermistors monitored (see heater_safety_channels)
+#define HEATER_SAFETY_CHANNEL_COUNT 4
+
+// Over-temperature monitor state and the last trip (for telemetry)
+typedef struct {
+    // true once tripped - the heaters are held OFF until cleared by ground
+    bool tripped;
+    // Number of samples in a row above the limit
+    uint8_t over_count;
+    // Number of trips (stops at 0xFF)
+    uint8_t trip_count;
+    // ADC2 channel and ADC code that caused the last trip
+    uint8_t trip_channel;
+    uint16_t trip_raw;
+    // Uptime of the last trip
+    uint32_t trip_time_s;
+    // Number of samples skipped because the SPI bus was in use
+    uint16_t skipped;
+} heater_safety_t;
+
+extern volatile heater_safety_t heater_safety;
+extern uint16_t heater_safety_limit_raw;
+extern const uint8_t heater_safety_channels[];
+
+void init_heater_safety(void);
+uint16_t fetch_therm_adc_channel(uint8_t channel);
+bool heater_safety_spi_idle(void);
+bool check_heater_safety_sample(uint16_t raw);
+void trip_heater_safety(uint8_t channel, uint16_t raw);
+void run_heater_safety(void);
+void clear_heater_safety_trip(void);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+Counts how long each heater has been ON, how much energy it has used and how
+many times it has switched, for building the payload power budget from flight
+data.
+
+The ON time is counted from the heater switching ON and OFF (see set_heaters()
+in heaters.c). The energy is measured once per second while any heater is ON,
+from the 6V boost converter's voltage and current (ADC1_BOOST6_VOLT_MON and
+ADC1_BOOST6_CURR_MON). The current the converter draws with no heaters ON is
+subtracted, and the rest is split between the heaters that are ON in
+proportion to their nominal currents (heater_nominal_curr_ma).
+
+The counters are kept in the configuration block (see config.c), so they
+continue after a reset and after firmware updates that add parameters. They are
+saved every HEATER_STATS_SAVE_PERIOD_S and when they are reset.
+*/
+
+#include "heater_stats.h"
+
+// Total ON time of each heater (index i is heater i + 1), not counting the
+// time since it last turned ON if it is ON now
+uint32_t heater_on_time_s[HEATER_STATS_COUNT];
+// Uptime each heater last turned ON
+uint32_t heater_on_since[HEATER_STATS_COUNT];
+// Total energy of each heater, in J and the remaining mJ
+uint32_t heater_energy_j[HEATER_STATS_COUNT];
+uint16_t heater_energy_mj[HEATER_STATS_COUNT];
+// Number of times each heater has switched ON or OFF
+uint32_t heater_switch_count[HEATER_STATS_COUNT];
+// Uptime each heater last switched ON or OFF
+uint32_t heater_last_switch_time[HEATER_STATS_COUNT];
+
+// Increase in the 6V boost current from each heater (mA), measured by
+// hk_sequential_heater_test() in the self-diagnostic harness
+const uint8_t heater_nominal_curr_ma[HEATER_STATS_COUNT] = {
+    140, 100, 140, 100, 175
+};
+// 6V boost current with no heaters ON
+uint16_t heater_boost6_idle_ma = 0;
+
+uint32_t heater_stats_last_save_time = 0;
+
+
+// Loads the counters from the configuration (all heaters must be OFF)
+void init_heater_stats(void) {
+    init_config();
+
+    for (uint8_t i = 0; i < HEATER_STATS_COUNT; i++) {
+        heater_on_time_s[i] = config.heater_on_time_s[i];
+        heater_on_since[i] = 0;
+        heater_energy_j[i] = config.heater_energy_j[i];
+        heater_energy_mj[i] = 0;
+        heater_switch_count[i] = config.heater_switch_count[i];
+        heater_last_switch_time[i] = 0;
+    }
+    heater_stats_last_save_time = uptime_s;
+}
+
+// Must be called when the heaters switch from prev_mask to mask (bit i =
+// heater i + 1)
+void heater_stats_switch(uint8_t prev_mask, uint8_t mask, uint32_t now_s) {
+    for (uint8_t i = 0; i < HEATER_STATS_COUNT; i++) {
+        bool was_on = (prev_mask >> i) & 0x01;
+        bool is_on = (mask >> i) & 0x01;
+
+        if (was_on == is_on) {
+            continue;
+        }
+
+        if (is_on) {
+            heater_on_since[i] = now_s;
+        } else {
+            heater_on_time_s[i] += now_s - heater_on_since[i];
+        }
+        heater_switch_count[i] += 1;
+        heater_last_switch_time[i] = now_s;
+    }
+}
+
+// Returns the total ON time of a heater (index 0 to 4), including the time
+// since it last turned ON if it is ON now
+uint32_t get_heater_on_time_s(uint8_t heater, uint8_t enables, uint32_t now_s) {
+    if (heater >= HEATER_STATS_COUNT) {
+        return 0;
+    }
+
+    uint32_t on_time_s = heater_on_time_s[heater];
+    if ((enables >> heater) & 0x01) {
+        on_time_s += now_s - heater_on_since[heater];
+    }
+    return on_time_s;
+}
+
+// Splits energy_mj between the heaters that are ON, in proportion to their
+// nominal currents
+void add_heater_energy_mj(uint8_t enables, uint32_t energy_mj) {
+    uint16_t total_ma = 0;
+    for (uint8_t i = 0; i < HEATER_STATS_COUNT; i++) {
+        if ((enables >> i) & 0x01) {
+            total_ma += heater_nominal_curr_ma[i];
+        }
+    }
+    if (total_ma == 0) {
+        return;
+    }
+
+    for (uint8_t i = 0; i < HEATER_STATS_COUNT; i++) {
+        if (!((enables >> i) & 0x01)) {
+            continue;
+        }
+
+        uint32_t mj = heater_energy_mj[i] +
+            ((energy_mj * heater_nominal_curr_ma[i]) / total_ma);
+        heater_energy_j[i] += mj / 1000;
+        heater_energy_mj[i] = mj % 1000;
+    }
+}
+
+/*
+Measures the 6V boost converter for one second of heater energy (must be called
+once per second). With no heaters ON, it updates the idle current instead.
+*/
+void sample_heater_power(uint8_t enables) {
+    uint16_t curr_raw = fetch_spi_adc_channel(&adc1, ADC1_BOOST6_CURR_MON);
+    double curr = adc_raw_to_circ_cur(curr_raw, ADC1_BOOST6_SENSE_RES,
+        ADC1_BOOST6_REF_VOL);
+    int32_t curr_ma = (int32_t) (curr * 1000.0);
+    if (curr_ma < 0) {
+        curr_ma = 0;
+    }
+
+    if (enables == 0) {
+        int32_t idle_ma = heater_boost6_idle_ma;
+        idle_ma += (curr_ma - idle_ma) / (1 << HEATER_STATS_IDLE_SHIFT);
+        heater_boost6_idle_ma = (uint16_t) idle_ma;
+        return;
+    }
+
+    uint16_t vol_raw = fetch_spi_adc_channel(&adc1, ADC1_BOOST6_VOLT_MON);
+    double vol = adc_raw_to_circ_vol(vol_raw, ADC1_BOOST6_LOW_RES,
+        ADC1_BOOST6_HIGH_RES);
+
+    int32_t heater_ma = curr_ma - heater_boost6_idle_ma;
+    if (heater_ma <= 0 || vol <= 0.0) {
+        return;
+    }
+    // mW for 1 second = mJ
+    add_heater_energy_mj(enables, (uint32_t) (vol * heater_ma));
+}
+
+// Saves the counters with the configuration
+void save_heater_stats(uint8_t enables, uint32_t now_s) {
+    for (uint8_t i = 0; i < HEATER_STATS_COUNT; i++) {
+        config.heater_on_time_s[i] = get_heater_on_time_s(i, enables, now_s);
+        config.heater_energy_j[i] = heater_energy_j[i];
+        config.heater_switch_count[i] = heater_switch_count[i];
+    }
+    save_config();
+    heater_stats_last_save_time = now_s;
+}
+
+// Sets all the counters to 0 and saves them
+void reset_heater_stats(uint8_t enables, uint32_t now_s) {
+    for (uint8_t i = 0; i < HEATER_STATS_COUNT; i++) {
+        heater_on_time_s[i] = 0;
+        heater_on_since[i] = now_s;
+        heater_energy_j[i] = 0;
+        heater_energy_mj[i] = 0;
+        heater_switch_count[i] = 0;
+    }
+    save_heater_stats(enables, now_s);
+}
+
+// Must be called once per second with the heaters that are ON
+void heater_stats_main(uint8_t enables, uint32_t now_s) {
+    sample_heater_power(enables);
+
+    if (now_s - heater_stats_last_save_time >= HEATER_STATS_SAVE_PERIOD_S) {
+        save_heater_stats(enables, now_s);
+    }
+}
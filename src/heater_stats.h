@@ -0,0 +1,42 @@
+#ifndef HEATER_STATS_H
+#define HEATER_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <adc/adc.h>
+#include <conversions/conversions.h>
+#include <uptime/uptime.h>
+
+#include "config.h"
+#include "devices.h"
+
+// Number of heaters (same as HEATER_COUNT)
+#define HEATER_STATS_COUNT          5
+// How often the counters are saved to EEPROM (at most this much is lost on a
+// reset) - see config.c for the EEPROM lifetime this gives
+#define HEATER_STATS_SAVE_PERIOD_S  1800
+// The 6V boost current with no heaters ON moves 1/2^HEATER_STATS_IDLE_SHIFT of
+// the way to each new sample
+#define HEATER_STATS_IDLE_SHIFT     3
+
+extern uint32_t heater_on_time_s[];
+extern uint32_t heater_on_since[];
+extern uint32_t heater_energy_j[];
+extern uint16_t heater_energy_mj[];
+extern uint32_t heater_switch_count[];
+extern uint32_t heater_last_switch_time[];
+extern const uint8_t heater_nominal_curr_ma[];
+extern uint16_t heater_boost6_idle_ma;
+extern uint32_t heater_stats_last_save_time;
+
+void init_heater_stats(void);
+void heater_stats_switch(uint8_t prev_mask, uint8_t mask, uint32_t now_s);
+uint32_t get_heater_on_time_s(uint8_t heater, uint8_t enables, uint32_t now_s);
+void add_heater_energy_mj(uint8_t enables, uint32_t energy_mj);
+void sample_heater_power(uint8_t enables);
+void save_heater_stats(uint8_t enables, uint32_t now_s);
+void reset_heater_stats(uint8_t enables, uint32_t now_s);
+void heater_stats_main(uint8_t enables, uint32_t now_s);
+
+#endif
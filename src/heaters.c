@@ -3,9 +3,21 @@ For pay-ssm v4, all heaters are controlled with software via PEX pins
 
 For Ganymede, all heater control pins are tied to PEX1, GPIOB0
 
-For now no PWM control, just turn it all ON or all OFF all the time.
-
-PWM regulation can be considered if want to reduce payload power consumption.
+Each heater is time-proportioned (slow PWM): every control period, a duty
+cycle is calculated for each heater from its zone temperature (by a PID
+controller, or bang-bang as a fallback), then the heater is kept ON for that
+fraction of the period. The ON windows of the heaters are
+staggered over the period to spread out the load on the 6V boost converter.
+Heaters are also started one at a time (see sequence_heater_starts()) so their
+inrush currents don't add up on the 6V boost converter.
+
+Each zone also has a learned thermal model (see thermal_model.c), which is used
+to start the PID integral term at the duty cycle that should hold the setpoint
+and to limit duty cycles that are predicted to overshoot the setpoint.
+
+Separately, an over-temperature monitor turns all the heaters OFF from a timer
+interrupt (see heater_safety.c), which also turns them OFF if the main loop
+stops updating them.
 
 Author: Lorna Lan
  */
@@ -18,130 +30,418 @@ Author: Lorna Lan
 #include "heaters.h"
 
 
+// Current control period, adjusted after every control pass between the
+// min/max (see update_heater_ctrl_period())
 uint32_t heater_ctrl_period_s = HEATER_CTRL_PERIOD_S;
+uint32_t heater_ctrl_period_min_s = HEATER_CTRL_PERIOD_MIN_S;
+uint32_t heater_ctrl_period_max_s = HEATER_CTRL_PERIOD_MAX_S;
+
+// Exponential moving averages of the thermistor ADC readings, with
+// THERM_FILTER_SHIFT fractional bits (see sample_therm_data())
+uint16_t therm_filtered_raw[THERMISTOR_COUNT];
+// false until the first sample is taken
+bool therm_filter_primed = false;
 
 uint16_t therm_readings_raw[THERMISTOR_COUNT];
-// in C
-double therm_readings_conv[THERMISTOR_COUNT];
+// in centi-degrees C (e.g. 1397 means 13.97 C)
+int16_t therm_readings_conv[THERMISTOR_COUNT];
 uint8_t therm_err_codes[THERMISTOR_COUNT];
-// 0 means elminated, 1 means normal
-uint8_t therm_enables[THERMISTOR_COUNT];
+// Bit i is thermistor i - 0 means elminated, 1 means normal
+uint16_t therm_enables = THERM_MASK_ALL;
+// Bit i is 1 if thermistor i is manually set valid/invalid by ground
+uint16_t therm_manual = 0;
 
+// Last setpoint set for all the zones at once
 uint16_t heaters_setpoint_raw = HEATERS_SETPOINT_RAW_DEFAULT;
+// Setpoint of each zone (heater i + 1), used by the control loop
+uint16_t heater_zone_setpoints_raw[HEATER_COUNT];
 uint16_t invalid_therm_reading_raw = INVALID_THERM_READING_RAW_DEFAULT;
-// 0 means OFF, 1 means ON
-uint8_t heater_enables[HEATER_COUNT];
+
+// Thresholds derived from the parameters above, so the control loop doesn't
+// need to convert them every time (see update_heater_thresholds())
+// in centi-degrees C
+int16_t heaters_setpoint_conv = 0;
+int16_t heater_zone_setpoints_conv[HEATER_COUNT];
+int16_t invalid_therm_reading_conv = 0;
+// Raw readings below therm_ull_raw are below THERM_CONV_ULL and raw readings
+// above therm_uhl_raw are above THERM_CONV_UHL
+uint16_t therm_ull_raw = 0;
+uint16_t therm_uhl_raw = 0x0FFF;
+// Bit i is heater i + 1 - 0 means OFF, 1 means ON
+uint8_t heater_enables = 0;
+
+// Thermistors averaged for each heater (index i is heater i + 1)
+// To remap a zone (e.g. after a thermistor fails), only this table changes
+const uint16_t heater_zone_masks[HEATER_COUNT] = {
+    HEATER1_THERM_MASK,
+    HEATER2_THERM_MASK,
+    HEATER3_THERM_MASK,
+    HEATER4_THERM_MASK,
+    HEATER5_THERM_MASK
+};
+// Average of each heater's zone (in centi-degrees C), from the last control pass
+int16_t heater_zone_temps[HEATER_COUNT];
+// Bit i is 1 if heater i + 1's zone had any enabled thermistors
+uint8_t heater_zone_valid = 0;
+// Zone averages from the control pass before, for how fast they are changing
+int16_t heater_zone_prev_temps[HEATER_COUNT];
+// Bit i is 1 if heater_zone_prev_temps[i] is from a valid zone
+uint8_t heater_zone_prev_valid = 0;
 
 uint32_t heater_ctrl_last_exec_time = 0;
 
+// Status from the last control pass (see update_heater_ctrl_status())
+heater_ctrl_status_t heater_ctrl_status;
+// Set to true to print the status after every control pass (for bench testing)
+bool print_heater_ctrl = false;
+
+// Duty cycle of each heater (0 to HEATER_DUTY_MAX), from the last control pass
+uint8_t heater_duties[HEATER_COUNT];
+// Last uptime the heater outputs were updated (also read by the timer
+// interrupt, so written atomically)
+uint32_t heater_pwm_last_update_time = 0;
+// true once heater_ctrl_main() has taken control of the heaters - until then
+// (e.g. test programs that switch them directly), the stall check is off
+bool heater_pwm_armed = false;
+// Number of times the heaters were turned OFF because the main loop stopped
+// updating them (stops at 0xFF)
+uint8_t heater_pwm_stall_count = 0;
+
+// Hysteresis for bang-bang control and minimum dwell times (see
+// HEATER_HYST_BAND_CENTI_DEFAULT, HEATER_MIN_ON_S_DEFAULT)
+uint16_t heater_hyst_band_centi = HEATER_HYST_BAND_CENTI_DEFAULT;
+uint16_t heater_min_on_s = HEATER_MIN_ON_S_DEFAULT;
+uint16_t heater_min_off_s = HEATER_MIN_OFF_S_DEFAULT;
+
+// Limits on starting heaters (see sequence_heater_starts())
+uint16_t heater_start_spacing_s = HEATER_START_SPACING_S;
+uint8_t heater_max_active = HEATER_MAX_ACTIVE_DEFAULT;
+uint16_t heater_boost6_curr_budget_ma = HEATER_BOOST6_CURR_BUDGET_MA;
+// Each heater (index) only starts if the raw 6V boost current is below this
+// (see update_heater_start_thresholds())
+uint16_t heater_start_curr_max_raw[HEATER_COUNT];
+// When the last heater was started and which one it was (index)
+uint32_t heater_last_start_time = 0;
+uint8_t heater_last_started = HEATER_COUNT - 1;
+
+// How the duty cycles are calculated (HEATER_CTRL_MODE_...)
+uint8_t heater_ctrl_mode = HEATER_CTRL_MODE_DEFAULT;
+pid_gains_t heater_pid_gains = {
+    .kp = PID_KP_DEFAULT,
+    .ki = PID_KI_DEFAULT,
+    .kd = PID_KD_DEFAULT
+};
+pid_state_t heater_pids[HEATER_COUNT];
+
+// Learned response of each zone to its heater
+thermal_model_t heater_models[HEATER_COUNT];
+// Number of seconds each heater has been ON since the last control pass
+uint16_t heater_pass_on_s[HEATER_COUNT];
+
 
 void init_heater_ctrl(void){
     set_pex_pin_dir(&pex2, PEX_B, HEATER1_EN_N, OUTPUT);
-    set_pex_pin(&pex2, PEX_B, HEATER1_EN_N, 1);
-
     set_pex_pin_dir(&pex2, PEX_B, HEATER2_EN_N, OUTPUT);
-    set_pex_pin(&pex2, PEX_B, HEATER2_EN_N, 1);
-
     set_pex_pin_dir(&pex2, PEX_B, HEATER3_EN_N, OUTPUT);
-    set_pex_pin(&pex2, PEX_B, HEATER3_EN_N, 1);
-
     set_pex_pin_dir(&pex2, PEX_B, HEATER4_EN_N, OUTPUT);
-    set_pex_pin(&pex2, PEX_B, HEATER4_EN_N, 1);
-
     set_pex_pin_dir(&pex2, PEX_B, HEATER5_EN_N, OUTPUT);
-    set_pex_pin(&pex2, PEX_B, HEATER5_EN_N, 1);
+    // All heaters off
+    set_heaters(0);
+
+    init_config();
+    // The configuration block has never been written (first start after the
+    // update to this firmware), so bring over the parameters from where they
+    // used to be stored - if it is invalid (corrupted, or from an incompatible
+    // version), everything stays at its default
+    if (config_status == CONFIG_STATUS_ERASED) {
+        import_legacy_heater_params();
+    }
+    init_heater_stats();
 
     for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
         therm_readings_raw[i] = 0;
-        //some specific double, this number doesn't matter anyway
-        therm_readings_conv[i] = 0.07;
-        // This should only be written to EEPROM when changed by CAN command
-        therm_err_codes[i] = (uint8_t) read_eeprom_or_default(
-            THERM_ERR_CODE_EEPROM_ADDR_BASE + (4 * i), THERM_ERR_CODE_NORMAL);
-        therm_enables[i] = 1;
+        therm_readings_conv[i] = 0;
+        therm_err_codes[i] = config.therm_err_codes[i];
     }
+    therm_enables = THERM_MASK_ALL;
+    therm_manual = 0;
 
-    heaters_setpoint_raw = (uint16_t) read_eeprom_or_default(
+    heaters_setpoint_raw = config.heaters_setpoint_raw;
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_zone_setpoints_raw[i] = config.heater_zone_setpoints_raw[i];
+    }
+    invalid_therm_reading_raw = config.invalid_therm_reading_raw;
+    update_heater_thresholds();
+
+    heater_ctrl_mode = config.heater_ctrl_mode;
+    heater_pid_gains = config.heater_pid_gains;
+    heater_hyst_band_centi = config.heater_hyst_band_centi;
+    heater_min_on_s = config.heater_min_on_s;
+    heater_min_off_s = config.heater_min_off_s;
+    heater_start_spacing_s = config.heater_start_spacing_s;
+    heater_max_active = config.heater_max_active;
+    heater_boost6_curr_budget_ma = config.heater_boost6_curr_budget_ma;
+    update_heater_start_thresholds();
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_duties[i] = 0;
+        reset_pid(&heater_pids[i]);
+        heater_pass_on_s[i] = 0;
+    }
+    reset_heater_models();
+}
+
+// Copies the parameters from their old individual EEPROM addresses into the
+// configuration block
+void import_legacy_heater_params(void) {
+    config.heaters_setpoint_raw = (uint16_t) read_eeprom_or_default(
         HEATERS_SETPOINT_EEPROM_ADDR, HEATERS_SETPOINT_RAW_DEFAULT);
-    invalid_therm_reading_raw = (uint16_t) read_eeprom_or_default(
+    config.invalid_therm_reading_raw = (uint16_t) read_eeprom_or_default(
         INVALID_THERM_READING_EEPROM_ADDR, INVALID_THERM_READING_RAW_DEFAULT);
-
+    // There was only one setpoint for all the zones
     for (uint8_t i = 0; i < HEATER_COUNT; i++) {
-        heater_enables[i] = 0;
-    }    
+        config.heater_zone_setpoints_raw[i] = config.heaters_setpoint_raw;
+    }
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++) {
+        config.therm_err_codes[i] = (uint8_t) read_eeprom_or_default(
+            THERM_ERR_CODE_EEPROM_ADDR_BASE + (4 * i), THERM_ERR_CODE_NORMAL);
+    }
+    save_config();
+}
+
+/*
+Switches every heater to the state in mask (bit i = heater i + 1, 1 = ON) with
+a single write to the PEX2 bank B output register, so all the heaters change
+at the same time. The other pins on bank B (e.g. the 6V boost enable) keep
+their current state (see update_pex2_bank_b()).
+
+This is done atomically so the heater stats always match the outputs.
+*/
+void set_heaters(uint8_t mask){
+    mask &= HEATER_MASK_ALL;
+    // Held OFF after an over-temperature trip
+    if(heater_safety.tripped){
+        mask = 0;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // Enable pins are active low
+        update_pex2_bank_b(HEATER_MASK_ALL << HEATER1_EN_N,
+            ((~mask) & HEATER_MASK_ALL) << HEATER1_EN_N);
+
+        heater_stats_switch(heater_enables, mask, uptime_s);
+        heater_enables = mask;
+    }
 }
 
 void heater_all_on(void) {
-    set_pex_pin(&pex2, PEX_B, HEATER1_EN_N, 0);
-    set_pex_pin(&pex2, PEX_B, HEATER2_EN_N, 0);
-    set_pex_pin(&pex2, PEX_B, HEATER3_EN_N, 0);
-    set_pex_pin(&pex2, PEX_B, HEATER4_EN_N, 0);
-    set_pex_pin(&pex2, PEX_B, HEATER5_EN_N, 0);
+    set_heaters(HEATER_MASK_ALL);
 }
 
 void heater_all_off(void) {
-    set_pex_pin(&pex2, PEX_B, HEATER1_EN_N, 1);
-    set_pex_pin(&pex2, PEX_B, HEATER2_EN_N, 1);
-    set_pex_pin(&pex2, PEX_B, HEATER3_EN_N, 1);
-    set_pex_pin(&pex2, PEX_B, HEATER4_EN_N, 1);
-    set_pex_pin(&pex2, PEX_B, HEATER5_EN_N, 1);
+    set_heaters(0);
 }
 
 void heater_on(uint8_t heater_num){
-    switch(heater_num){
-    case 1:
-        set_pex_pin(&pex2, PEX_B, HEATER1_EN_N, 0);
-        break;
-    case 2:
-        set_pex_pin(&pex2, PEX_B, HEATER2_EN_N, 0);
-        break;
-    case 3:
-        set_pex_pin(&pex2, PEX_B, HEATER3_EN_N, 0);
-        break;
-    case 4:
-        set_pex_pin(&pex2, PEX_B, HEATER4_EN_N, 0);
-        break;
-    case 5:
-        set_pex_pin(&pex2, PEX_B, HEATER5_EN_N, 0);
-        break;
-    default:
+    if (heater_num < 1 || heater_num > HEATER_COUNT) {
         return;
-        break;
     }
+    set_heaters(heater_enables | _BV(heater_num - 1));
 }
 
 void heater_off(uint8_t heater_num){
-    switch(heater_num){
-    case 1:
-        set_pex_pin(&pex2, PEX_B, HEATER1_EN_N, 1);
-        break;
-    case 2:
-        set_pex_pin(&pex2, PEX_B, HEATER2_EN_N, 1);
-        break;
-    case 3:
-        set_pex_pin(&pex2, PEX_B, HEATER3_EN_N, 1);
-        break;
-    case 4:
-        set_pex_pin(&pex2, PEX_B, HEATER4_EN_N, 1);
-        break;
-    case 5:
-        set_pex_pin(&pex2, PEX_B, HEATER5_EN_N, 1);
-        break;
-    default:
+    if (heater_num < 1 || heater_num > HEATER_COUNT) {
         return;
-        break;
     }
+    set_heaters(heater_enables & ~_BV(heater_num - 1));
 }
 
 
+// Must be called whenever heaters_setpoint_raw, heater_zone_setpoints_raw or
+// invalid_therm_reading_raw change
+void update_heater_thresholds(void) {
+    heaters_setpoint_conv = (int16_t) (dac_raw_data_to_heater_setpoint(
+        heaters_setpoint_raw) * 100);
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_zone_setpoints_conv[i] = (int16_t) (
+            dac_raw_data_to_heater_setpoint(heater_zone_setpoints_raw[i]) * 100);
+    }
+    invalid_therm_reading_conv =
+        adc_raw_to_therm_centi(invalid_therm_reading_raw);
+
+    therm_ull_raw = therm_centi_to_adc_raw(THERM_CONV_ULL * 100);
+    therm_uhl_raw = therm_centi_to_adc_raw((THERM_CONV_UHL * 100) + 1) - 1;
+}
+
+// Sets the setpoint of all the zones
 void set_heaters_setpoint_raw(uint16_t setpoint) {
     heaters_setpoint_raw = setpoint;
-    write_eeprom(HEATERS_SETPOINT_EEPROM_ADDR, heaters_setpoint_raw);
+    config.heaters_setpoint_raw = setpoint;
+    for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+        heater_zone_setpoints_raw[i] = setpoint;
+        config.heater_zone_setpoints_raw[i] = setpoint;
+    }
+    update_heater_thresholds();
+    save_config();
+}
+
+// heater is 0 to 4 (physical heater number - 1)
+uint16_t get_heater_zone_setpoint_raw(uint8_t heater) {
+    if (heater >= HEATER_COUNT) {
+        return 0;
+    }
+    return heater_zone_setpoints_raw[heater];
+}
+
+// Sets the setpoint of one zone (heater is 0 to 4)
+void set_heater_zone_setpoint_raw(uint8_t heater, uint16_t setpoint) {
+    if (heater >= HEATER_COUNT) {
+        return;
+    }
+    heater_zone_setpoints_raw[heater] = setpoint;
+    config.heater_zone_setpoints_raw[heater] = setpoint;
+    update_heater_thresholds();
+    save_config();
 }
 
 void set_invalid_therm_reading_raw(uint16_t reading) {
     invalid_therm_reading_raw = reading;
-    write_eeprom(INVALID_THERM_READING_EEPROM_ADDR, invalid_therm_reading_raw);
+    update_heater_thresholds();
+    config.invalid_therm_reading_raw = invalid_therm_reading_raw;
+    save_config();
+}
+
+void set_heater_ctrl_mode(uint8_t mode) {
+    if (mode != HEATER_CTRL_MODE_BANG_BANG && mode != HEATER_CTRL_MODE_PID) {
+        return;
+    }
+
+    // Start the controllers over so they don't use old state
+    if (mode != heater_ctrl_mode) {
+        for (uint8_t i = 0; i < HEATER_COUNT; i++) {
+            reset_pid(&heater_pids[i]);
+        }
+    }
+
+    heater_ctrl_mode = mode;
+    config.heater_ctrl_mode = heater_ctrl_mode;
+    save_config();
+}
+
+// index - HEATER_PID_KP/KI/KD
+uint16_t get_heater_pid_gain(uint8_t index) {
+    switch (index) {
+        case HEATER_PID_KP:
+            return heater_pid_gains.kp;
+        case HEATER_PID_KI:
+            return heater_pid_gains.ki;
+        case HEATER_PID_KD:
+            return heater_pid_gains.kd;
+        default:
+            return 0;
+    }
+}
+
+/*
+index - HEATER_PID_KP/KI/KD
+gain - must be at most PID_GAIN_MAX, or run_pid() could overflow
+Returns true if the gain was set.
+*/
+bool set_heater_pid_gain(uint8_t index, uint16_t gain) {
+    if (gain > PID_GAIN_MAX) {
+        return false;
+    }
+
+    switch (index) {
+        case HEATER_PID_KP:
+            heater_pid_gains.kp = gain;
+            break;
+        case HEATER_PID_KI:
+            heater_pid_gains.ki = gain;
+            break;
+        case HEATER_PID_KD:
+            heater_pid_gains.kd = gain;
+            break;
+        default:
+            return false;
+    }
+
+    config.heater_pid_gains = heater_pid_gains;
+    save_config();
+    return true;
+}
+
+// index - HEATER_SWITCH_...
+uint16_t get_heater_switch_param(uint8_t index) {
+    switch (index) {
+        case HEATER_SWITCH_HYST_BAND:
+            return heater_hyst_band_centi;
+        case HEATER_SWITCH_MIN_ON:
+            return heater_min_on_s;
+        case HEATER_SWITCH_MIN_OFF:
+            return heater_min_off_s;
+        default:
+            return 0;
+    }
+}
+
+// index - HEATER_SWITCH_...
+void set_heater_switch_param(uint8_t index, uint16_t value) {
+    switch (index) {
+        case HEATER_SWITCH_HYST_BAND:
+            heater_hyst_band_centi = value;
+            config.heater_hyst_band_centi = value;
+            break;
+        case HEATER_SWITCH_MIN_ON:
+            heater_min_on_s = value;
+            config.heater_min_on_s = value;
+            break;
+        case HEATER_SWITCH_MIN_OFF:
+            heater_min_off_s = value;
+            config.heater_min_off_s = value;
+            break;
+        default:
+            return;
+    }
+
+    save_config();
+}
+
+// index - HEATER_START_...
+uint16_t get_heater_start_param(uint8_t index) {
+    switch (index) {
+        case HEATER_START_SPACING:
+            return heater_start_spacing_s;
+        case HEATER_START_MAX_ACTIVE:
+            return heater_max_active;
+        case HEATER_START_CURR_BUDGET:
+            return heater_boost6_curr_budget_ma;
+        default:
+            return 0;
+    }
+}
+
+// index - HEATER_START_...
+void set_heater_start_param(uint8_t index, uint16_t value) {
+    switch (index) {
+        case HEATER_START_SPACING:
+            heater_start_spacing_s = value;
+            config.heater_start_spacing_s = value;
+            break;
+        case HEATER_START_MAX_ACTIVE:
+            heater_max_active = (value > HEATER_COUNT) ?
+                HEATER_COUNT : (uint8_t) value;
+            config.heater_max_active = heater_max_active;
+            break;
+        case HEATER_START_CURR_BUDGET:
+            heater_boost6_curr_budget_ma = value;
+            config.heater_boost6_curr_budget_ma = value;
+            update_heater_start_thresholds();
+            break;
+        default:
+            return;
+    }
+
+    save_config();
 }
 
 // This is only intended to be used by CAN commands when it should be written to
@@ -152,310 +452,788 @@ void set_therm_err_code(uint8_t index, uint8_t err_code) {
     }
 
     therm_err_codes[index] = err_code;
-    write_eeprom(THERM_ERR_CODE_EEPROM_ADDR_BASE + (4 * index),
-        therm_err_codes[index]);
+    config.therm_err_codes[index] = err_code;
+    save_config();
 }
 
-//manual test copy in manual_tests/heaters_test/heater_ctrl.c
 /*
- * Utility function: return number of 1s in a binary string
+ * Utility function: return number of 1s in a bitmask
  */
-uint16_t count_ones(uint8_t* array, uint8_t size){
-    uint16_t one_count = 0;
-    for (uint8_t i = 0; i < size; i++) {
-        if (array[i]) {
-            one_count += 1;
-        }
+uint8_t count_ones(uint16_t mask){
+    uint8_t one_count = 0;
+    // Each iteration clears the lowest set bit
+    while (mask) {
+        mask &= mask - 1;
+        one_count += 1;
     }
 
     return one_count;
 }
 
-uint32_t enables_to_uint(uint8_t* enables, uint32_t count) {
-    uint32_t ret = 0;
-    for (uint32_t i = 0; i < count; i++) {
-        if (enables[i]) {
-            ret |= (1 << i);
-        }
-    }
-    return ret;
-}
-
-
-// does not need to be atomic when polling ADC data
-void acquire_therm_data(void){
-    // poll all ADC2 channels
-    fetch_all_adc_channels(&adc2);
 
-    //convert to temperature and store in therm_readings_raw
+/*
+Samples all the thermistors and adds them to the filtered readings (called once
+per second by heater_ctrl_main() between control passes). Each filtered reading
+moves 1/2^THERM_FILTER_SHIFT of the way to the new sample, so a single noisy
+conversion has little effect.
+
+The channels are read one at a time through fetch_therm_adc_channel(), which
+claims the SPI bus for each one, so the over-temperature monitor can't change
+the ADC channel in the middle of a read but can still run between them.
+*/
+void sample_therm_data(void){
     for (uint8_t i = 0; i < THERMISTOR_COUNT; i++){
-        therm_readings_raw[i] = read_adc_channel(&adc2, i);
-        therm_readings_conv[i] = adc_raw_to_therm_temp(therm_readings_raw[i]);
+        uint16_t raw = fetch_therm_adc_channel(i);
+        if (therm_filter_primed) {
+            therm_filtered_raw[i] += raw - (therm_filtered_raw[i] >> THERM_FILTER_SHIFT);
+        } else {
+            // Start from the first sample instead of 0
+            therm_filtered_raw[i] = raw << THERM_FILTER_SHIFT;
+        }
     }
+    therm_filter_primed = true;
 }
 
-bool is_therm_valid(uint8_t err_code) {
-    if (err_code == THERM_ERR_CODE_NORMAL ||
-            err_code == THERM_ERR_CODE_MANUAL_VALID) {
-        return true;
-    } else {
-        return false;
+// Gets the thermistor readings for a control pass from the filtered readings
+void acquire_therm_data(void){
+    if (!therm_filter_primed) {
+        sample_therm_data();
     }
-}
 
-bool is_therm_manual(uint8_t err_code) {
-    if (err_code == THERM_ERR_CODE_MANUAL_INVALID ||
-            err_code == THERM_ERR_CODE_MANUAL_VALID) {
-        return true;
-    } else {
-        return false;
+    // Round the filtered readings to ADC codes for therm_readings_raw, and
+    // convert them with their fractional bits for therm_readings_conv
+    for (uint8_t i = 0; i < THERMISTOR_COUNT; i++){
+        uint16_t filtered = therm_filtered_raw[i];
+        // Round to the nearest ADC code
+        therm_readings_raw[i] = (filtered + _BV(THERM_FILTER_SHIFT - 1)) >>
+            THERM_FILTER_SHIFT;
+        // Use the fractional bits for a finer conversion
+        therm_readings_conv[i] = adc_raw_frac_to_therm_centi(filtered,
+            THERM_FILTER_SHIFT);
     }
 }
 
 void update_therm_statuses(void){
+    therm_enables = 0;
+    therm_manual = 0;
+
     for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
+        uint16_t bit = _BV(i);
+
         // For any manually controlled thermistors, directly set the enable
         if(therm_err_codes[i] == THERM_ERR_CODE_MANUAL_INVALID){
-            therm_enables[i] = 0;
+            therm_manual |= bit;
         }
         else if(therm_err_codes[i] == THERM_ERR_CODE_MANUAL_VALID){
-            therm_enables[i] = 1;
+            therm_manual |= bit;
+            therm_enables |= bit;
+        }
+        //compare with both lower and upper limits first
+        else if(therm_readings_raw[i] < therm_ull_raw){
+            therm_err_codes[i] = THERM_ERR_CODE_BELOW_ULL;
+        }
+        else if(therm_readings_raw[i] > therm_uhl_raw){
+            therm_err_codes[i] = THERM_ERR_CODE_ABOVE_UHL;
         }
         // If not manually controlled, default assume normal
         else {
-            therm_enables[i] = 1;
+            therm_enables |= bit;
             therm_err_codes[i] = THERM_ERR_CODE_NORMAL;
         }
     }
 
-    for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
-        //bypass ground-set thermistors
-        if(!is_therm_manual(therm_err_codes[i])){
-            //compare with both lower and upper limits first
-            if(therm_readings_conv[i] < THERM_CONV_ULL){
-                therm_enables[i] = 0;
-                therm_err_codes[i] = THERM_ERR_CODE_BELOW_ULL;
-            }
-            else if(therm_readings_conv[i] > THERM_CONV_UHL){
-                therm_enables[i] = 0;
-                therm_err_codes[i] = THERM_ERR_CODE_ABOVE_UHL;
+    // Use the median and median absolute deviation (MAD) instead of the mean
+    // and a fixed range, so one bad reading can't shift the center enough to
+    // eliminate good thermistors
+    // This is done for each zone, since zones with different setpoints can
+    // be far apart (bit j of checked_zones is 1 if zone j has enough valid
+    // thermistors to find an outlier)
+    int16_t zone_medians[HEATER_COUNT];
+    int16_t zone_ranges[HEATER_COUNT];
+    uint8_t checked_zones = 0;
+    for(uint8_t j = 0; j < HEATER_COUNT; j++){
+        uint8_t valid_therm_num = 0;
+        int16_t vals[THERMISTOR_COUNT];
+        for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
+            if(therm_enables & heater_zone_masks[j] & _BV(i)){
+                vals[valid_therm_num] = therm_readings_conv[i];
+                valid_therm_num += 1;
             }
         }
-    }
-
-    uint16_t valid_therm_num = count_ones(therm_enables, THERMISTOR_COUNT);
 
 #ifdef HEATERS_DEBUG
-    print("valid_therm_num: %u\n", valid_therm_num);
+        print("zone %u: valid_therm_num: %u\n", j + 1, valid_therm_num);
 #endif
 
-    if(valid_therm_num > 0){
-        //compute mean
-        //
-        double sum = 0.0;
-        for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
-            if(is_therm_valid(therm_err_codes[i])){
-                sum += therm_readings_conv[i];
-            }
+        if(valid_therm_num < THERM_MAD_MIN_COUNT){
+            continue;
         }
 
-        double miu = sum/valid_therm_num;
+        int16_t median = median_centi(vals, valid_therm_num);
+        for(uint8_t i = 0; i < valid_therm_num; i++){
+            int16_t dev = vals[i] - median;
+            vals[i] = dev < 0 ? -dev : dev;
+        }
+        int16_t mad = median_centi(vals, valid_therm_num);
+
+        zone_medians[j] = median;
+        zone_ranges[j] = therm_mad_range_centi(mad);
+        checked_zones |= _BV(j);
 
 #ifdef HEATERS_DEBUG
-        print("miu = %f\n", miu);
+        print("median = %d, MAD = %d, range = %d\n", median, mad,
+            zone_ranges[j]);
 #endif
+    }
 
-        // eliminate resistors more than +-10C from the average
-        // again, bypass ground-set thermistors
-        for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
-            if(!is_therm_manual(therm_err_codes[i])){
-                //compare with both lower and upper limits first
-                if(therm_readings_conv[i] < (miu-10)){
-                    therm_enables[i] = 0;
-                    therm_err_codes[i] = THERM_ERR_CODE_BELOW_MIU;
-                }
-                else if(therm_readings_conv[i] > (miu+10)){
-                    therm_enables[i] = 0;
-                    therm_err_codes[i] = THERM_ERR_CODE_ABOVE_MIU;
-                }
+    // eliminate thermistors too far from the median of every zone they are in
+    // (a thermistor that agrees with one of its zones is kept)
+    // again, bypass ground-set thermistors
+    for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
+        uint16_t bit = _BV(i);
+        if(!(therm_enables & bit) || (therm_manual & bit)){
+            continue;
+        }
+
+        uint8_t err_code = THERM_ERR_CODE_NORMAL;
+        for(uint8_t j = 0; j < HEATER_COUNT; j++){
+            if(!(checked_zones & _BV(j)) || !(heater_zone_masks[j] & bit)){
+                continue;
+            }
+
+            if(therm_readings_conv[i] < (zone_medians[j] - zone_ranges[j])){
+                err_code = THERM_ERR_CODE_BELOW_MIU;
+            }
+            else if(therm_readings_conv[i] > (zone_medians[j] + zone_ranges[j])){
+                err_code = THERM_ERR_CODE_ABOVE_MIU;
             }
+            else {
+                err_code = THERM_ERR_CODE_NORMAL;
+                break;
+            }
+        }
+
+        if(err_code != THERM_ERR_CODE_NORMAL){
+            therm_enables &= ~bit;
+            therm_err_codes[i] = err_code;
         }
     }
 }
 
 
-void heater_toggle(double calc_num, uint8_t heater_num){
-    //NOTE: heater_num here is the physical heater number - 1
-
-    double setpoint_conv = dac_raw_data_to_heater_setpoint(heaters_setpoint_raw);
+/*
+Returns the k-th smallest (starting from 0) of the count values, using
+quickselect (linear time on average). Reorders vals.
+*/
+int16_t select_kth(int16_t* vals, uint8_t count, uint8_t k){
+    uint8_t left = 0;
+    uint8_t right = count - 1;
+
+    while(left < right){
+        // Partition around the middle value
+        int16_t pivot = vals[left + ((right - left) / 2)];
+        uint8_t i = left;
+        uint8_t j = right;
+        while(i <= j){
+            while(vals[i] < pivot){
+                i += 1;
+            }
+            while(vals[j] > pivot){
+                j -= 1;
+            }
+            if(i <= j){
+                int16_t temp = vals[i];
+                vals[i] = vals[j];
+                vals[j] = temp;
+                i += 1;
+                if(j == 0){
+                    break;
+                }
+                j -= 1;
+            }
+        }
 
-    // hot case
-    if(calc_num > setpoint_conv){
-        if(heater_enables[heater_num]){
-            //heater ON, need to turn it OFF
-            heater_off(heater_num+1);
-            heater_enables[heater_num] = 0;
+        // Now vals[left..j] <= pivot <= vals[i..right]
+        if(k <= j){
+            right = j;
+        } else if(k >= i){
+            left = i;
+        } else {
+            break;
         }
     }
-    // cold case
-    else if(calc_num < setpoint_conv){
-        if(!heater_enables[heater_num]){
-            //heater OFF, need to turn it ON
-            heater_on(heater_num+1);
-            heater_enables[heater_num] = 1;
+
+    return vals[k];
+}
+
+
+/*
+Returns the median of the count values (count must be at least 1), averaging
+the middle two values if count is even. Reorders vals.
+*/
+int16_t median_centi(int16_t* vals, uint8_t count){
+    uint8_t k = (count - 1) / 2;
+    int16_t lower = select_kth(vals, count, k);
+    if(count % 2 == 1){
+        return lower;
+    }
+
+    // Everything after index k is >= lower, so the upper middle value is the
+    // smallest of those
+    int16_t upper = vals[k + 1];
+    for(uint8_t i = k + 2; i < count; i++){
+        if(vals[i] < upper){
+            upper = vals[i];
         }
     }
+    return (int16_t) (((int32_t) lower + upper) / 2);
 }
 
 
-// hardcode the heaters based on physical setup
-void heater_3in_ctrl(void){
-    //looking at heater 2 & 4, remember to minus one for bit shift in function argument
-    double avg_reading = 0.0;
-    double sum = 0.0;
-    uint8_t normal_therm_num = 0;
+/*
+Returns how far a thermistor can be from the median (in centi-degrees C)
+before it is eliminated, given the MAD of all the valid readings.
+This is THERM_MAD_K times the MAD scaled to a standard deviation (1.4826 for
+normally distributed readings), limited to
+[THERM_MAD_RANGE_MIN_CENTI, THERM_MAD_RANGE_MAX_CENTI] so tightly clustered
+readings don't eliminate thermistors for small differences.
+*/
+int16_t therm_mad_range_centi(int16_t mad){
+    int32_t range = ((int32_t) mad * THERM_MAD_K * 1483) / 1000;
+    if(range < THERM_MAD_RANGE_MIN_CENTI){
+        return THERM_MAD_RANGE_MIN_CENTI;
+    }
+    if(range > THERM_MAD_RANGE_MAX_CENTI){
+        return THERM_MAD_RANGE_MAX_CENTI;
+    }
+    return (int16_t) range;
+}
 
-    // heater 2
-    // averaging TH4-6 (start counting from 1)
-    for(uint8_t i = 3; i < 6; i++){
-        if(is_therm_valid(therm_err_codes[i])){
+
+// Returns the average of the readings of the enabled thermistors in mask (in
+// centi-degrees C), or the default invalid reading if there are none
+int16_t avg_therm_readings(uint16_t mask){
+    mask &= therm_enables;
+    if(!mask){
+        // no working thermistors, rip
+        return invalid_therm_reading_conv;
+    }
+
+    int32_t sum = 0;
+    uint8_t normal_therm_num = 0;
+    for(uint8_t i = 0; mask; i++, mask >>= 1){
+        if(mask & 0x01){
             sum += therm_readings_conv[i];
             normal_therm_num += 1;
         }
     }
+    return (int16_t) (sum / normal_therm_num);
+}
 
-    if(normal_therm_num > 0){
-        avg_reading = (sum/normal_therm_num);
-    } else {
-        // no working thermistors, rip
-        avg_reading = adc_raw_to_therm_temp(invalid_therm_reading_raw);
+
+// calc_num is in centi-degrees C
+// Returns the duty cycle (0 to HEATER_DUTY_MAX) for heater_num (physical heater
+// number - 1), using the current control mode
+uint8_t calc_heater_duty(uint8_t heater_num, int16_t calc_num){
+    thermal_model_t* model = &heater_models[heater_num];
+    int16_t setpoint = heater_zone_setpoints_conv[heater_num];
+    uint8_t duty = 0;
+
+    if(heater_ctrl_mode == HEATER_CTRL_MODE_BANG_BANG){
+        int32_t half_band = heater_hyst_band_centi / 2;
+        // hot case
+        if(calc_num > (int32_t) setpoint + half_band){
+            duty = 0;
+        }
+        // cold case
+        else if(calc_num < (int32_t) setpoint - half_band){
+            duty = HEATER_DUTY_MAX;
+        }
+        // within the band around the setpoint, stay the same
+        else{
+            duty = heater_duties[heater_num];
+        }
     }
-    heater_toggle(avg_reading, 1);
 
-    // heater 4
-    // averaging TH7-9 (start counting from 1)
-    sum = 0.0;
-    normal_therm_num = 0;
-    for(uint8_t i = 6; i < 9; i++){
-        if(is_therm_valid(therm_err_codes[i])){
-            sum += therm_readings_conv[i];
-            normal_therm_num += 1;
+    else{
+        pid_state_t* pid = &heater_pids[heater_num];
+        // Start the integral term at the duty cycle the model predicts will
+        // hold the setpoint, instead of winding it up from 0
+        if(!pid->primed && thermal_model_valid(model)){
+            pid->integral = (int32_t) thermal_model_duty_for_rate(model, 0) <<
+                PID_FRAC_BITS;
+        }
+
+        uint32_t dt_s = heater_ctrl_period_s;
+        if(dt_s > PID_DT_MAX_S){
+            dt_s = PID_DT_MAX_S;
         }
+        duty = run_pid(pid, &heater_pid_gains, setpoint, calc_num,
+            (uint16_t) dt_s, HEATER_PID_RATE_MAX);
     }
 
-    if(normal_therm_num > 0){
-        avg_reading = (sum/normal_therm_num);
-    } else {
-        avg_reading = adc_raw_to_therm_temp(invalid_therm_reading_raw);
+    return limit_heater_duty(model, setpoint, calc_num, duty);
+}
+
+
+// Returns one value of a heater's thermal model (heater is 0 to 4, index is
+// HEATER_MODEL_...)
+uint32_t get_heater_model_value(uint8_t heater, uint8_t index){
+    if(heater >= HEATER_COUNT){
+        return 0;
+    }
+    const thermal_model_t* model = &heater_models[heater];
+
+    switch(index){
+        case HEATER_MODEL_GAIN:
+            return (uint32_t) model->gain;
+        case HEATER_MODEL_OFF_RATE:
+            return (uint32_t) thermal_model_off_rate(model);
+        case HEATER_MODEL_HOLD_DUTY:
+            if(!thermal_model_valid(model)){
+                return 0xFF;
+            }
+            return thermal_model_duty_for_rate(model, 0);
+        case HEATER_MODEL_UPDATES:
+            return model->updates;
+        default:
+            return 0;
     }
-    heater_toggle(avg_reading, 3);
 }
 
+// Forgets the thermal models (e.g. if the payload's thermal setup changed),
+// so they aren't used until they have learned again
+void reset_heater_models(void){
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        reset_thermal_model(&heater_models[i]);
+    }
+}
 
-void heater_4in_ctrl(void){
-    //looking at heater 1 & 3, remember to minus one for bit shift in function argument
+/*
+Limits a duty cycle so the zone (at temperature calc_num) is not predicted by
+its model to go past its setpoint by the end of the next control period. Does
+nothing until the model is valid.
+*/
+uint8_t limit_heater_duty(const thermal_model_t* model, int16_t setpoint,
+        int16_t calc_num, uint8_t duty){
+    if(!thermal_model_valid(model) || heater_ctrl_period_s == 0){
+        return duty;
+    }
 
-    double avg_reading = 0.0;
-    double sum = 0.0;
-    uint8_t normal_therm_num = 0;
+    // Rate that would reach the setpoint exactly at the end of the period
+    int32_t rate = (((int32_t) setpoint - calc_num) * 60) /
+        (int32_t) heater_ctrl_period_s;
+    uint8_t duty_max = thermal_model_duty_for_rate(model, rate);
+    return (duty < duty_max) ? duty : duty_max;
+}
 
-    // heater 1
-    // averaging TH5-6, TH10-12
-    for(uint8_t i = 9; i < 12; i++){
-        if(is_therm_valid(therm_err_codes[i])){
-            sum += therm_readings_conv[i];
-            normal_therm_num += 1;
+
+/*
+Returns which heaters should be ON (bit i = heater i + 1) phase_s seconds into
+the control period.
+
+Heater i is ON for (duty * period) seconds, starting (i * period / HEATER_COUNT)
+seconds into the period (wrapping around to the start of the period), so the
+heaters do not all turn on at the same time. ON windows shorter than
+heater_min_on_s are dropped and OFF windows shorter than heater_min_off_s are
+filled in, since the heater couldn't switch that quickly anyway (see
+apply_heater_dwell()).
+*/
+uint8_t heater_pwm_mask(uint32_t phase_s){
+    uint32_t period_s = heater_ctrl_period_s;
+    uint8_t mask = 0;
+
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        if(period_s == 0){
+            // No time to divide up, just use ON/OFF
+            if(heater_duties[i] > 0){
+                mask |= _BV(i);
+            }
+            continue;
+        }
+
+        uint32_t on_time_s = (heater_duties[i] * period_s) / HEATER_DUTY_MAX;
+        if(on_time_s < heater_min_on_s){
+            on_time_s = 0;
+        }
+        if(on_time_s < period_s && period_s - on_time_s < heater_min_off_s){
+            on_time_s = period_s;
+        }
+        uint32_t start_s = (i * period_s) / HEATER_COUNT;
+        // Time since this heater's window started
+        uint32_t window_s = (phase_s + period_s - start_s) % period_s;
+
+        if(window_s < on_time_s){
+            mask |= _BV(i);
         }
     }
 
-    for(uint8_t i = 4; i < 6; i++){
-        if(is_therm_valid(therm_err_codes[i])){
-            sum += therm_readings_conv[i];
-            normal_therm_num += 1;
+    return mask;
+}
+
+
+/*
+Returns target (which heaters should be ON) with each heater that switched too
+recently kept in its current state (current) at uptime now_s - a heater stays
+ON for at least heater_min_on_s and OFF for at least heater_min_off_s. This
+limits how often the heaters switch (each switch is PEX SPI traffic and a
+current step on the 6V boost converter).
+*/
+uint8_t apply_heater_dwell(uint8_t current, uint8_t target, uint32_t now_s){
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        uint8_t bit = _BV(i);
+        if(!((current ^ target) & bit)){
+            continue;
+        }
+
+        uint32_t since_s = now_s - heater_last_switch_time[i];
+        if((current & bit) && since_s < heater_min_on_s){
+            target |= bit;
+        } else if(!(current & bit) && since_s < heater_min_off_s){
+            target &= ~bit;
         }
     }
 
-    if(normal_therm_num > 0){
-        avg_reading = (sum/normal_therm_num);
-    } else {
-        avg_reading = adc_raw_to_therm_temp(invalid_therm_reading_raw);
+    return target;
+}
+
+
+// Returns the lowest raw ADC1_BOOST6_CURR_MON code that is at least curr_ma
+// (0x1000 if the ADC can't measure that much)
+uint16_t boost6_curr_ma_to_adc_raw(int16_t curr_ma){
+    // The conversion increases with the code, so binary search for it
+    uint16_t low = 0;
+    uint16_t high = 0x1000;
+    while(low < high){
+        uint16_t mid = (low + high) / 2;
+        double curr = adc_raw_to_circ_cur(mid, ADC1_BOOST6_SENSE_RES,
+            ADC1_BOOST6_REF_VOL);
+        if(curr * 1000.0 >= curr_ma){
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
     }
-    heater_toggle(avg_reading, 0);
+    return low;
+}
 
-    // heater 3
-    // averaging TH1-3 and TH8-9 (start counting from 1)
-    sum = 0.0;
-    normal_therm_num = 0;
-    for(uint8_t i = 0; i < 3; i++){
-        if(is_therm_valid(therm_err_codes[i])){
-            sum += therm_readings_conv[i];
-            normal_therm_num += 1;
+// Must be called whenever heater_boost6_curr_budget_ma changes, so starting a
+// heater only compares ADC codes
+void update_heater_start_thresholds(void){
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        int16_t max_ma = (int16_t) heater_boost6_curr_budget_ma -
+            heater_nominal_curr_ma[i];
+        heater_start_curr_max_raw[i] = (max_ma > 0) ?
+            boost6_curr_ma_to_adc_raw(max_ma) : 0;
+    }
+}
+
+// Returns true if heater (index) can start with the 6V boost current at
+// curr_raw (ADC code) without going over the budget
+bool heater_curr_within_budget(uint8_t heater, uint16_t curr_raw){
+    if(heater_boost6_curr_budget_ma == HEATER_BOOST6_CURR_BUDGET_NONE){
+        return true;
+    }
+    return curr_raw < heater_start_curr_max_raw[heater];
+}
+
+
+/*
+Returns which heaters should be ON (bit i = heater i + 1) to go from current
+towards target at uptime now_s, starting at most one heater.
+
+Heaters turning OFF are switched right away. A heater only starts if:
+- at least heater_start_spacing_s has passed since the last heater started
+- fewer than heater_max_active heaters are ON
+- the measured 6V boost current plus the heater's nominal current is within
+  heater_boost6_curr_budget_ma
+The heaters waiting to start take turns (starting after the last one that
+started), so the same heater isn't always the one delayed. A heater that would
+go over the current budget is skipped for a smaller one. The others start on
+later calls.
+*/
+uint8_t sequence_heater_starts(uint8_t current, uint8_t target, uint32_t now_s){
+    uint8_t mask = current & target & HEATER_MASK_ALL;
+    uint8_t waiting = target & ~current & HEATER_MASK_ALL;
+
+    if(waiting == 0){
+        return mask;
+    }
+    if(now_s - heater_last_start_time < heater_start_spacing_s){
+        return mask;
+    }
+    if(count_ones(mask) >= heater_max_active){
+        return mask;
+    }
+    // Only measure the current if a heater would start
+    uint16_t curr_raw = 0;
+    if(heater_boost6_curr_budget_ma != HEATER_BOOST6_CURR_BUDGET_NONE){
+        curr_raw = fetch_spi_adc_channel(&adc1, ADC1_BOOST6_CURR_MON);
+    }
+
+    for(uint8_t j = 1; j <= HEATER_COUNT; j++){
+        uint8_t i = (heater_last_started + j) % HEATER_COUNT;
+        if((waiting & _BV(i)) && heater_curr_within_budget(i, curr_raw)){
+            heater_last_started = i;
+            heater_last_start_time = now_s;
+            mask |= _BV(i);
+            break;
         }
     }
 
-    for(uint8_t i = 7; i < 9; i++){
-        if(is_therm_valid(therm_err_codes[i])){
-            sum += therm_readings_conv[i];
-            normal_therm_num += 1;
+    return mask;
+}
+
+
+// Switches the heaters towards their PWM state phase_s seconds into the period
+// (a heater that has to wait to start loses that time from its ON window)
+void update_heater_pwm(uint32_t phase_s){
+    // Keep writing OFF while tripped, in case the PEX missed a write
+    if(heater_safety.tripped){
+        set_heaters(0);
+        return;
+    }
+
+    uint32_t now = uptime_s;
+    uint8_t target = apply_heater_dwell(heater_enables, heater_pwm_mask(phase_s),
+        now);
+    uint8_t mask = sequence_heater_starts(heater_enables, target, now);
+    if(mask != heater_enables){
+        set_heaters(mask);
+    }
+}
+
+
+// Returns true if heaters are ON and the main loop hasn't updated them for more
+// than HEATER_PWM_STALL_MAX_S at uptime now_s (only once heater_ctrl_main()
+// is switching them)
+bool heater_pwm_stalled(uint32_t now_s){
+    return heater_pwm_armed && heater_enables != 0 &&
+        now_s - heater_pwm_last_update_time > HEATER_PWM_STALL_MAX_S;
+}
+
+/*
+Called from the over-temperature monitor's timer interrupt (with the SPI bus
+idle). The heaters are switched by the main loop, so if it is blocked, a heater
+could stay ON long past the end of its window. This turns all the heaters OFF
+once the outputs haven't been updated for HEATER_PWM_STALL_MAX_S, and the main
+loop switches them back on its next update.
+*/
+void check_heater_pwm_stall(void){
+    if(!heater_pwm_stalled(uptime_s)){
+        return;
+    }
+
+    set_heaters(0);
+    if(heater_pwm_stall_count < 0xFF){
+        heater_pwm_stall_count += 1;
+    }
+}
+
+
+/*
+Calculates the average of the enabled thermistors in every heater zone (see
+heater_zone_masks) and stores them in heater_zone_temps. Each enabled reading
+is only visited once and added to every zone that uses it. Zones with no
+enabled thermistors use the default invalid reading.
+*/
+void update_heater_zone_temps(void){
+    int32_t sums[HEATER_COUNT] = { 0 };
+    uint8_t counts[HEATER_COUNT] = { 0 };
+
+    uint16_t enables = therm_enables;
+    for(uint8_t i = 0; enables; i++, enables >>= 1){
+        if(!(enables & 0x01)){
+            continue;
+        }
+
+        uint16_t bit = _BV(i);
+        for(uint8_t j = 0; j < HEATER_COUNT; j++){
+            if(heater_zone_masks[j] & bit){
+                sums[j] += therm_readings_conv[i];
+                counts[j] += 1;
+            }
         }
     }
 
-    if(normal_therm_num > 0){
-        avg_reading = (sum/normal_therm_num);
-    } else {
-        avg_reading = adc_raw_to_therm_temp(invalid_therm_reading_raw);
+    heater_zone_valid = 0;
+    for(uint8_t j = 0; j < HEATER_COUNT; j++){
+        if(counts[j] > 0){
+            heater_zone_temps[j] = (int16_t) (sums[j] / counts[j]);
+            heater_zone_valid |= _BV(j);
+        } else {
+            // no working thermistors, rip
+            heater_zone_temps[j] = invalid_therm_reading_conv;
+        }
     }
-    heater_toggle(avg_reading, 2);
 }
 
 
-void heater_5in_ctrl(void){
-    // looking at heater 5 here, average everything
-    double avg_reading = 0.0;
-    double sum = 0.0;
-    uint8_t normal_therm_num = 0;
+/*
+Updates each zone's thermal model with the last control pass (how fast the zone
+changed and how long its heater was actually ON), then starts counting the ON
+time for the next pass. Zones that weren't valid for both passes are skipped.
 
-    for(uint8_t i = 0; i < 12; i++){
-        if(is_therm_valid(therm_err_codes[i])){
-            sum += therm_readings_conv[i];
-            normal_therm_num += 1;
+Must be called after the zone temperatures are updated and before
+update_heater_ctrl_period(), since that replaces heater_zone_prev_temps and
+heater_ctrl_period_s.
+*/
+void update_heater_models(void){
+    uint32_t elapsed_s = heater_ctrl_period_s;
+
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        uint8_t bit = _BV(i);
+        if((heater_zone_valid & bit) && (heater_zone_prev_valid & bit) &&
+                elapsed_s > 0){
+            uint32_t on_s = heater_pass_on_s[i];
+            if(on_s > elapsed_s){
+                on_s = elapsed_s;
+            }
+            uint8_t duty = (uint8_t) ((on_s * HEATER_DUTY_MAX) / elapsed_s);
+            int32_t rate = (((int32_t) heater_zone_temps[i] -
+                heater_zone_prev_temps[i]) * 60) / (int32_t) elapsed_s;
+            update_thermal_model(&heater_models[i], duty, rate);
         }
+
+        heater_pass_on_s[i] = 0;
+    }
+}
+
+
+void average_heaters(void){
+    update_heater_zone_temps();
+    update_heater_models();
+
+    // The heaters are switched by update_heater_pwm() over the period
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        heater_duties[i] = calc_heater_duty(i, heater_zone_temps[i]);
     }
+}
 
-    if(normal_therm_num > 0){
-        avg_reading = (sum/normal_therm_num);
+
+/*
+Chooses the next control period from the zone temperatures of this control
+pass. If any valid zone is more than HEATER_CTRL_STABLE_BAND_CENTI from the
+setpoint or changing faster than HEATER_CTRL_STABLE_RATE_CENTI per minute, the
+period drops to the minimum. Otherwise it doubles, up to the maximum.
+
+Must be called after the duty cycles are calculated, since heater_ctrl_period_s
+is the time since the last pass until then.
+*/
+void update_heater_ctrl_period(void){
+    uint32_t elapsed_s = heater_ctrl_period_s;
+    bool stable = true;
+
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        uint8_t bit = _BV(i);
+        if(!(heater_zone_valid & bit)){
+            continue;
+        }
+
+        int32_t err = (int32_t) heater_zone_temps[i] -
+            heater_zone_setpoints_conv[i];
+        if(err > HEATER_CTRL_STABLE_BAND_CENTI ||
+                err < -HEATER_CTRL_STABLE_BAND_CENTI){
+            stable = false;
+        }
+
+        // Don't know the rate until there are two readings
+        if(!(heater_zone_prev_valid & bit) || elapsed_s == 0){
+            stable = false;
+            continue;
+        }
+        int32_t change = (int32_t) heater_zone_temps[i] - heater_zone_prev_temps[i];
+        if(change < 0){
+            change = -change;
+        }
+        if((change * 60) / (int32_t) elapsed_s > HEATER_CTRL_STABLE_RATE_CENTI){
+            stable = false;
+        }
+    }
+
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        heater_zone_prev_temps[i] = heater_zone_temps[i];
+    }
+    heater_zone_prev_valid = heater_zone_valid;
+
+    if(stable){
+        heater_ctrl_period_s *= 2;
     } else {
-        avg_reading = adc_raw_to_therm_temp(invalid_therm_reading_raw);
+        heater_ctrl_period_s = heater_ctrl_period_min_s;
+    }
+
+    if(heater_ctrl_period_s < heater_ctrl_period_min_s){
+        heater_ctrl_period_s = heater_ctrl_period_min_s;
+    }
+    if(heater_ctrl_period_s > heater_ctrl_period_max_s){
+        heater_ctrl_period_s = heater_ctrl_period_max_s;
     }
-    heater_toggle(avg_reading, 4);
 }
 
 
-void average_heaters(void){
-    heater_3in_ctrl();
-    heater_4in_ctrl();
-    heater_5in_ctrl();
+// Fills in heater_ctrl_status from the current state
+void update_heater_ctrl_status(void){
+    heater_ctrl_status.version = HEATER_CTRL_STATUS_VERSION;
+    heater_ctrl_status.mode = heater_ctrl_mode;
+    heater_ctrl_status.uptime_s = uptime_s;
+    heater_ctrl_status.period_s = (uint16_t) heater_ctrl_period_s;
+    heater_ctrl_status.setpoint_raw = heaters_setpoint_raw;
+    heater_ctrl_status.invalid_therm_reading_raw = invalid_therm_reading_raw;
+    for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
+        heater_ctrl_status.therm_readings_raw[i] = therm_readings_raw[i];
+    }
+    heater_ctrl_status.therm_enables = therm_enables;
+    heater_ctrl_status.therm_manual = therm_manual;
+    heater_ctrl_status.heater_enables = heater_enables;
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        heater_ctrl_status.heater_duties[i] = heater_duties[i];
+        heater_ctrl_status.heater_zone_temps[i] = heater_zone_temps[i];
+        heater_ctrl_status.heater_zone_setpoints_raw[i] =
+            heater_zone_setpoints_raw[i];
+    }
 }
 
 
 void print_heater_ctrl_status(void){
     //print thermistors status
     for(uint8_t i = 0; i < THERMISTOR_COUNT; i++){
-        print("Therm %02u, Reading: 0x%x (%.5f C), Status: 0x%.2x, Enabled: %u\n",
-            i + 1, therm_readings_raw[i], therm_readings_conv[i],
-            therm_err_codes[i], therm_enables[i]);
+        print("Therm %02u, Reading: 0x%x (%.2f C), Status: 0x%.2x, Enabled: %u\n",
+            i + 1, therm_readings_raw[i], therm_readings_conv[i] / 100.0,
+            therm_err_codes[i], (therm_enables >> i) & 0x01);
     }
 
-    print("Heater setpoint: 0x%x (%.5f C)\n",
-        heaters_setpoint_raw,
-        dac_raw_data_to_heater_setpoint(heaters_setpoint_raw));
-    print("Default invalid thermistor reading: 0x%x (%.5f C)\n",
-        invalid_therm_reading_raw,
-        adc_raw_to_therm_temp(invalid_therm_reading_raw));
+    print("Last setpoint for all heaters: 0x%x (%.2f C)\n",
+        heaters_setpoint_raw, heaters_setpoint_conv / 100.0);
+    print("Default invalid thermistor reading: 0x%x (%.2f C)\n",
+        invalid_therm_reading_raw, invalid_therm_reading_conv / 100.0);
+    print("Control period: %lu s\n", heater_ctrl_period_s);
+    print("Control mode: %u, PID gains: %u, %u, %u\n", heater_ctrl_mode,
+        heater_pid_gains.kp, heater_pid_gains.ki, heater_pid_gains.kd);
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        print("Heater %u model: %.2f C/min at 100%%, %.2f C/min OFF, %u updates\n",
+            i + 1, thermal_model_rate(&heater_models[i], HEATER_DUTY_MAX) / 100.0,
+            thermal_model_off_rate(&heater_models[i]) / 25600.0,
+            heater_models[i].updates);
+    }
+    print("Hysteresis band: %.2f C, min ON: %u s, min OFF: %u s\n",
+        heater_hyst_band_centi / 100.0, heater_min_on_s, heater_min_off_s);
+    if(heater_safety.tripped){
+        print("Over-temperature trip: channel %u, 0x%x, at %lu s\n",
+            heater_safety.trip_channel, heater_safety.trip_raw,
+            heater_safety.trip_time_s);
+    }
+    print("Heater starts: %u s apart, max %u ON, 6V budget %u mA\n",
+        heater_start_spacing_s, heater_max_active, heater_boost6_curr_budget_ma);
+    print("Heaters turned OFF by a stalled main loop: %u\n",
+        heater_pwm_stall_count);
 
     //print heater status
     for(uint8_t i = 0; i < HEATER_COUNT; i++){
-        print("Heater %u, Enabled: %u\n", i+1, heater_enables[i]);
+        print("Heater %u, Setpoint: 0x%x (%.2f C), Zone: %.2f C, Duty: %u%%, Enabled: %u\n",
+            i + 1, heater_zone_setpoints_raw[i],
+            heater_zone_setpoints_conv[i] / 100.0,
+            heater_zone_temps[i] / 100.0, heater_duties[i],
+            (heater_enables >> i) & 0x01);
     }
     print("\n");
 }
@@ -465,19 +1243,48 @@ void run_heater_ctrl(void){
     acquire_therm_data();
     update_therm_statuses();
     average_heaters();
+    update_heater_ctrl_period();
+    add_therm_history_record(uptime_s, therm_readings_raw, heater_enables,
+        therm_enables);
 
     // store status to the correct place
-    print_heater_ctrl_status();
+    update_heater_ctrl_status();
+    if(print_heater_ctrl){
+        print_heater_ctrl_status();
+    }
 }
 
 
 // heater control loop to be called in main
 void heater_ctrl_main(void){
-    // currently update every 1 minute
-    if((uptime_s - heater_ctrl_last_exec_time) < heater_ctrl_period_s){
+    uint32_t now = uptime_s;
+
+    // The thermistors are sampled and the heater outputs are updated once per
+    // second (not from the uptime interrupt since the ADC and PEX share the
+    // SPI bus with the main loop)
+    if(now == heater_pwm_last_update_time){
         return;
     }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        heater_pwm_last_update_time = now;
+        heater_pwm_armed = true;
+    }
+
+    sample_therm_data();
+
+    if((now - heater_ctrl_last_exec_time) >= heater_ctrl_period_s){
+        heater_ctrl_last_exec_time = now;
+        run_heater_ctrl ();
+    }
+
+    update_heater_pwm(now - heater_ctrl_last_exec_time);
+
+    // ON time for the thermal models
+    for(uint8_t i = 0; i < HEATER_COUNT; i++){
+        if(heater_enables & _BV(i)){
+            heater_pass_on_s[i] += 1;
+        }
+    }
 
-    heater_ctrl_last_exec_time = uptime_s;
-    run_heater_ctrl (); 
+    heater_stats_main(heater_enables, now);
 }
@@ -3,32 +3,149 @@
 
 #include <stdbool.h>
 #include <avr/eeprom.h>
+#include <util/atomic.h>
 #include <uptime/uptime.h>
+#include "config.h"
 #include "devices.h"
+#include "heater_pid.h"
+#include "heater_safety.h"
+#include "heater_stats.h"
+#include "therm_history.h"
+#include "therm_lut.h"
+#include "thermal_model.h"
 
 
-#define HEATER_CTRL_PERIOD_S 60
+// Initial control period
+#define HEATER_CTRL_PERIOD_S        60
+// Bounds for the control period, which is shortened when the zones are away
+// from the setpoint or changing quickly and lengthened when they are stable
+#define HEATER_CTRL_PERIOD_MIN_S    10
+#define HEATER_CTRL_PERIOD_MAX_S    120
+// Zones are stable when they are within this much of the setpoint and change
+// by less than this much per minute (in centi-degrees C)
+#define HEATER_CTRL_STABLE_BAND_CENTI   100
+#define HEATER_CTRL_STABLE_RATE_CENTI   50
 
 #define THERMISTOR_COUNT    12
+// Filtered thermistor readings move 1/2^THERM_FILTER_SHIFT of the way to each
+// new sample (sampled once per second)
+#define THERM_FILTER_SHIFT  3
 #define HEATER_COUNT        5
 
-// Heaters all ON/OFF only (no PWM), controlled by PEX2
-// All on Bank B
+// Masks with a bit for every thermistor/heater
+#define THERM_MASK_ALL      ((1 << THERMISTOR_COUNT) - 1)
+#define HEATER_MASK_ALL     ((1 << HEATER_COUNT) - 1)
+
+// Thermistors averaged for each heater (bit i is thermistor i + 1), based on
+// the physical setup (see heater_zone_masks)
+#define HEATER1_THERM_MASK  0x0E30  // TH5-6, TH10-12
+#define HEATER2_THERM_MASK  0x0038  // TH4-6
+#define HEATER3_THERM_MASK  0x0187  // TH1-3, TH8-9
+#define HEATER4_THERM_MASK  0x01C0  // TH7-9
+#define HEATER5_THERM_MASK  THERM_MASK_ALL
+
+// Heaters are ON/OFF (time-proportioned by software), controlled by PEX2
+// All on Bank B, on consecutive pins (set together by set_heaters())
 #define HEATER1_EN_N       3
 #define HEATER2_EN_N       4
 #define HEATER3_EN_N       5
 #define HEATER4_EN_N       6
 #define HEATER5_EN_N       7
 
+// Limits on starting heaters, so their inrush currents are spread out on the
+// 6V boost converter (see sequence_heater_starts())
+// Minimum time between starting two heaters (the outputs are updated once per
+// second, so 1 means one heater per update)
+#define HEATER_START_SPACING_S          1
+// Maximum number of heaters ON at the same time - by default all of them, so
+// the spacing only staggers the starts and doesn't cap the heating power
+// (below HEATER_COUNT, a heater can wait for a whole period when the others
+// are at full duty)
+#define HEATER_MAX_ACTIVE_DEFAULT       HEATER_COUNT
+// A heater only starts if the 6V boost current (ADC1_BOOST6_CURR_MON) plus the
+// heater's nominal current (heater_nominal_curr_ma) stays within this (mA) -
+// all 5 heaters draw about 655 mA plus the boost converter's idle current
+// (see hk_sequential_heater_test() in the self-diagnostic harness), so the
+// default leaves room for all of them and only catches a heater drawing more
+// than it should. Ground can lower it to limit the load.
+#define HEATER_BOOST6_CURR_BUDGET_MA    1000
+// Budget that disables the current check
+#define HEATER_BOOST6_CURR_BUDGET_NONE  0
+
+// Index of each start parameter (for CAN commands)
+#define HEATER_START_SPACING        0
+#define HEATER_START_MAX_ACTIVE     1
+#define HEATER_START_CURR_BUDGET    2
+
+// Bang-bang control turns a heater ON below the setpoint by more than half of
+// the hysteresis band and OFF above it by more than half the band (in
+// centi-degrees C), so it doesn't switch every pass near the setpoint
+#define HEATER_HYST_BAND_CENTI_DEFAULT  100
+// Once a heater switches, it stays ON/OFF for at least this long
+#define HEATER_MIN_ON_S_DEFAULT         2
+#define HEATER_MIN_OFF_S_DEFAULT        2
+
+// Index of each switching parameter (for CAN commands)
+#define HEATER_SWITCH_HYST_BAND     0
+#define HEATER_SWITCH_MIN_ON        1
+#define HEATER_SWITCH_MIN_OFF       2
+
+// If the main loop hasn't updated the heater outputs for more than this long
+// (e.g. blocked by a long operation), the timer interrupt turns them all OFF
+// (see check_heater_pwm_stall()) - programs that switch the heaters directly
+// without heater_ctrl_main() aren't affected
+#define HEATER_PWM_STALL_MAX_S  5
+
+// Heater duty cycles are in percent
+#define HEATER_DUTY_MAX         100
+// Maximum change in a heater's PID duty cycle per control period (in percent)
+#define HEATER_PID_RATE_MAX     25
+
+// How the heater duty cycles are calculated
+// Bang-bang - full duty below the setpoint, 0 above the setpoint
+#define HEATER_CTRL_MODE_BANG_BANG  0
+#define HEATER_CTRL_MODE_PID        1
+#define HEATER_CTRL_MODE_DEFAULT    HEATER_CTRL_MODE_PID
+
+// Index of each PID gain (for CAN commands)
+#define HEATER_PID_KP   0
+#define HEATER_PID_KI   1
+#define HEATER_PID_KD   2
+
+// Index of each thermal model value (for CAN commands)
+// Gain - fixed point centi-degrees C per minute per percent duty (int32)
+#define HEATER_MODEL_GAIN       0
+// Rate with the heater OFF - fixed point centi-degrees C per minute (int32)
+#define HEATER_MODEL_OFF_RATE   1
+// Duty cycle predicted to hold the setpoint (percent, 0xFF if the model isn't
+// valid yet)
+#define HEATER_MODEL_HOLD_DUTY  2
+// Number of updates
+#define HEATER_MODEL_UPDATES    3
+
 //temperature constants (in raw ADC 12-bit form)
 // Default 14 C sepoint
 #define HEATERS_SETPOINT_RAW_DEFAULT        0x328
 // Default 20 C reading for invalid thermistors
 #define INVALID_THERM_READING_RAW_DEFAULT   0x39F
 
+// Limits in C
 #define THERM_CONV_ULL -35
 #define THERM_CONV_UHL 120
+// Thermistors are eliminated if they are more than THERM_MAD_K scaled median
+// absolute deviations from the median of each zone they are in, within these
+// limits (in centi-degrees C)
+// The minimum is the same 10 C range used before the MAD, since thermistors
+// next to an ON heater normally read several degrees above the others
+#define THERM_MAD_K                 3
+#define THERM_MAD_RANGE_MIN_CENTI   1000
+#define THERM_MAD_RANGE_MAX_CENTI   2000
+// Zones with fewer valid thermistors than this aren't used to find outliers
+// (the median of 2 readings is as far from both of them)
+#define THERM_MAD_MIN_COUNT         3
 
+// Where the parameters were stored before the configuration block (see
+// config.h) - only read if the configuration block was never written
 #define HEATERS_SETPOINT_EEPROM_ADDR        0x300
 #define INVALID_THERM_READING_EEPROM_ADDR   0x304
 // This is for thermistor 0, for each thermistor add 4
@@ -41,8 +158,8 @@
  * 0 - normal/not eliminated
  * 1 - lower than ultra low limit (ULL)
  * 2 - higher than ultra high limit (UHL)
- * 3 - lower than mean (miu) of all 12 thermistors by more than 10C
- * 4 - higher than mean (miu) of all 12 thermistors by more than 10C
+ * 3 - lower than median of each zone it is in by more than the MAD range
+ * 4 - higher than median of each zone it is in by more than the MAD range
  * 5 - ground manual set to invalid
  * 6 - ground manual set to valid
  * 7 - unused
@@ -55,41 +172,138 @@
 #define THERM_ERR_CODE_MANUAL_INVALID   0x05
 #define THERM_ERR_CODE_MANUAL_VALID     0x06
 
+/*
+Status from the last control pass, in a fixed layout so it can be sent as-is
+(e.g. with CAN_PAY_CTRL_READ_HEAT_CTRL_STATUS) instead of being printed.
+Multi-byte fields are little endian (AVR memory order), with no padding
+(HEATER_CTRL_STATUS_LEN bytes in total). Increase HEATER_CTRL_STATUS_VERSION
+if the layout changes.
+*/
+#define HEATER_CTRL_STATUS_VERSION  2
+#define HEATER_CTRL_STATUS_LEN      66
+
+typedef struct {
+    uint8_t version;
+    // HEATER_CTRL_MODE_...
+    uint8_t mode;
+    uint32_t uptime_s;
+    uint16_t period_s;
+    // Last setpoint set for all the zones at once (see heater_zone_setpoints_raw)
+    uint16_t setpoint_raw;
+    uint16_t invalid_therm_reading_raw;
+    uint16_t therm_readings_raw[THERMISTOR_COUNT];
+    uint16_t therm_enables;
+    uint16_t therm_manual;
+    uint8_t heater_enables;
+    // percent
+    uint8_t heater_duties[HEATER_COUNT];
+    // centi-degrees C
+    int16_t heater_zone_temps[HEATER_COUNT];
+    // Setpoint used for each zone
+    uint16_t heater_zone_setpoints_raw[HEATER_COUNT];
+} heater_ctrl_status_t;
+
 
 extern uint32_t heater_ctrl_period_s;
+extern uint32_t heater_ctrl_period_min_s;
+extern uint32_t heater_ctrl_period_max_s;
 
+extern uint16_t therm_filtered_raw[];
+extern bool therm_filter_primed;
 extern uint16_t therm_readings_raw[];
-extern double therm_readings_conv[];
+extern int16_t therm_readings_conv[];
 extern uint8_t therm_err_codes[];
-extern uint8_t therm_enables[];
+extern uint16_t therm_enables;
+extern uint16_t therm_manual;
 
 extern uint16_t heaters_setpoint_raw;
+extern uint16_t heater_zone_setpoints_raw[];
 extern uint16_t invalid_therm_reading_raw;
-extern uint8_t heater_enables[];
+extern int16_t heaters_setpoint_conv;
+extern int16_t heater_zone_setpoints_conv[];
+extern int16_t invalid_therm_reading_conv;
+extern uint16_t therm_ull_raw;
+extern uint16_t therm_uhl_raw;
+extern uint8_t heater_enables;
+extern const uint16_t heater_zone_masks[];
+extern int16_t heater_zone_temps[];
+extern uint8_t heater_zone_valid;
+extern int16_t heater_zone_prev_temps[];
+extern uint8_t heater_zone_prev_valid;
 
 extern uint32_t heater_ctrl_last_exec_time;
+extern heater_ctrl_status_t heater_ctrl_status;
+extern bool print_heater_ctrl;
+extern uint8_t heater_duties[];
+extern uint32_t heater_pwm_last_update_time;
+extern bool heater_pwm_armed;
+extern uint8_t heater_pwm_stall_count;
+extern uint16_t heater_hyst_band_centi;
+extern uint16_t heater_min_on_s;
+extern uint16_t heater_min_off_s;
+extern uint16_t heater_start_spacing_s;
+extern uint8_t heater_max_active;
+extern uint16_t heater_boost6_curr_budget_ma;
+extern uint16_t heater_start_curr_max_raw[];
+extern uint32_t heater_last_start_time;
+extern uint8_t heater_last_started;
+extern uint8_t heater_ctrl_mode;
+extern pid_gains_t heater_pid_gains;
+extern pid_state_t heater_pids[];
+extern thermal_model_t heater_models[];
+extern uint16_t heater_pass_on_s[];
 
 
 void init_heater_ctrl(void);
+void import_legacy_heater_params(void);
+void set_heaters(uint8_t mask);
 void heater_all_on(void);
 void heater_all_off(void);
 void heater_on(uint8_t);
 void heater_off(uint8_t);
 
+void update_heater_thresholds(void);
 void set_heaters_setpoint_raw(uint16_t setpoint);
+uint16_t get_heater_zone_setpoint_raw(uint8_t heater);
+void set_heater_zone_setpoint_raw(uint8_t heater, uint16_t setpoint);
 void set_invalid_therm_reading_raw(uint16_t reading);
+void set_heater_ctrl_mode(uint8_t mode);
+uint16_t get_heater_pid_gain(uint8_t index);
+bool set_heater_pid_gain(uint8_t index, uint16_t gain);
 void set_therm_err_code(uint8_t index, uint8_t err_code);
+uint16_t get_heater_switch_param(uint8_t index);
+void set_heater_switch_param(uint8_t index, uint16_t value);
+uint16_t get_heater_start_param(uint8_t index);
+void set_heater_start_param(uint8_t index, uint16_t value);
 
 //heater control loop stuff
-uint16_t count_ones(uint8_t* array, uint8_t size);
-uint32_t enables_to_uint(uint8_t* enables, uint32_t count);
+uint8_t count_ones(uint16_t mask);
+void sample_therm_data (void);
 void acquire_therm_data (void);
 void update_therm_statuses (void);
-void heater_toggle(double, uint8_t);
-void heater_3in_ctrl (void);
-void heater_4in_ctrl (void);
-void heater_5in_ctrl (void);
+int16_t select_kth(int16_t* vals, uint8_t count, uint8_t k);
+int16_t median_centi(int16_t* vals, uint8_t count);
+int16_t therm_mad_range_centi(int16_t mad);
+int16_t avg_therm_readings(uint16_t mask);
+uint8_t calc_heater_duty(uint8_t heater_num, int16_t calc_num);
+uint32_t get_heater_model_value(uint8_t heater, uint8_t index);
+void reset_heater_models(void);
+uint8_t limit_heater_duty(const thermal_model_t* model, int16_t setpoint,
+    int16_t calc_num, uint8_t duty);
+uint8_t heater_pwm_mask(uint32_t phase_s);
+uint8_t apply_heater_dwell(uint8_t current, uint8_t target, uint32_t now_s);
+uint16_t boost6_curr_ma_to_adc_raw(int16_t curr_ma);
+void update_heater_start_thresholds(void);
+bool heater_curr_within_budget(uint8_t heater, uint16_t curr_raw);
+uint8_t sequence_heater_starts(uint8_t current, uint8_t target, uint32_t now_s);
+void update_heater_pwm(uint32_t phase_s);
+bool heater_pwm_stalled(uint32_t now_s);
+void check_heater_pwm_stall(void);
+void update_heater_zone_temps (void);
+void update_heater_models (void);
 void average_heaters (void);
+void update_heater_ctrl_period (void);
+void update_heater_ctrl_status (void);
 void print_heater_ctrl_status (void);
 void run_heater_ctrl (void);
 void heater_ctrl_main (void);
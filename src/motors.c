@@ -76,6 +76,7 @@ void init_motors(void) {
 void enable_motors(void) {
     // Enable motors and disable sleep
 
+    claim_spi_bus();
     // nSLEEP = 1, logic HIGH to enable device
     set_pex_pin(&pex1, PEX_B, MOT1_SLP_N, 1);
     set_pex_pin(&pex1, PEX_B, MOT2_SLP_N, 1);
@@ -87,11 +88,13 @@ void enable_motors(void) {
     // BENBL = 1
     set_pex_pin(&pex1, PEX_B, MOT1_BENBL, 1);
     set_pex_pin(&pex1, PEX_A, MOT2_BENBL, 1);
+    release_spi_bus();
 }
 
 void enable_motor1(void) {
     // Enable motor1 only
 
+    claim_spi_bus();
     // nSLEEP = 1
     set_pex_pin(&pex1, PEX_B, MOT1_SLP_N, 1);
 
@@ -100,11 +103,13 @@ void enable_motor1(void) {
 
     // BENBL = 1
     set_pex_pin(&pex1, PEX_B, MOT1_BENBL, 1);
+    release_spi_bus();
 }
 
 void enable_motor2(void) {
     // Enable motor2 only
 
+    claim_spi_bus();
     // nSLEEP = 1
     set_pex_pin(&pex1, PEX_B, MOT2_SLP_N, 1);
 
@@ -113,11 +118,13 @@ void enable_motor2(void) {
 
     // BENBL = 1
     set_pex_pin(&pex1, PEX_A, MOT2_BENBL, 1);
+    release_spi_bus();
 }
 
 void disable_motors(void) {
     // Disable motors and enable sleep
 
+    claim_spi_bus();
     // nSLEEP = 0
     set_pex_pin(&pex1, PEX_B, MOT1_SLP_N, 0);
     set_pex_pin(&pex1, PEX_B, MOT2_SLP_N, 0);
@@ -129,11 +136,13 @@ void disable_motors(void) {
     // BENBL = 0
     set_pex_pin(&pex1, PEX_B, MOT1_BENBL, 0);
     set_pex_pin(&pex1, PEX_A, MOT2_BENBL, 0);
+    release_spi_bus();
 }
 
 void disable_motor1(void) {
     // Disable motor1 only
 
+    claim_spi_bus();
     // nSLEEP = 0
     set_pex_pin(&pex1, PEX_B, MOT1_SLP_N, 0);
 
@@ -142,11 +151,13 @@ void disable_motor1(void) {
 
     // BENBL = 0
     set_pex_pin(&pex1, PEX_B, MOT1_BENBL, 0);
+    release_spi_bus();
 }
 
 void disable_motor2(void) {
     // Disable motor2 only
 
+    claim_spi_bus();
     // nSLEEP = 0
     set_pex_pin(&pex1, PEX_B, MOT2_SLP_N, 0);
 
@@ -155,6 +166,15 @@ void disable_motor2(void) {
 
     // BENBL = 0
     set_pex_pin(&pex1, PEX_A, MOT2_BENBL, 0);
+    release_spi_bus();
+}
+
+// Returns 1 if the limit switch on PEX2 bank A pin is pressed
+uint8_t read_lim_switch(uint8_t pin) {
+    claim_spi_bus();
+    uint8_t pressed = get_pex_pin(&pex2, PEX_A, pin);
+    release_spi_bus();
+    return pressed;
 }
 
 /*
@@ -331,8 +351,8 @@ void motors_routine(void){
     last_exec_time_motors = uptime_s;
 
     // when limit switch not pressed, pex pin reading should return 0
-    uint8_t switch1_pressed = get_pex_pin(&pex2, PEX_A, LIM_SWT1_PRESSED);
-    uint8_t switch2_pressed = get_pex_pin(&pex2, PEX_A, LIM_SWT2_PRESSED);
+    uint8_t switch1_pressed = read_lim_switch(LIM_SWT1_PRESSED);
+    uint8_t switch2_pressed = read_lim_switch(LIM_SWT2_PRESSED);
 
     // number of times each motor actuated
     uint16_t count_mot1 = 0;
@@ -357,12 +377,12 @@ void motors_routine(void){
         count_mot2 += 1;
 
         //update switch status
-        switch1_pressed = get_pex_pin(&pex2, PEX_A, LIM_SWT1_PRESSED);
+        switch1_pressed = read_lim_switch(LIM_SWT1_PRESSED);
         if(switch1_pressed){
             count_lim_switch1 += 1;
         }
 
-        switch2_pressed = get_pex_pin(&pex2, PEX_A, LIM_SWT2_PRESSED);
+        switch2_pressed = read_lim_switch(LIM_SWT2_PRESSED);
         if(switch2_pressed){
             count_lim_switch2 += 1;
         }
@@ -383,12 +403,12 @@ void motors_routine(void){
             }
 
             //update switch status
-            switch1_pressed = get_pex_pin(&pex2, PEX_A, LIM_SWT1_PRESSED);
+            switch1_pressed = read_lim_switch(LIM_SWT1_PRESSED);
             if(switch1_pressed){
                 count_lim_switch1 += 1;
             }
 
-            switch2_pressed = get_pex_pin(&pex2, PEX_A, LIM_SWT2_PRESSED);
+            switch2_pressed = read_lim_switch(LIM_SWT2_PRESSED);
             if(switch2_pressed){
                 count_lim_switch2 += 1;
             }
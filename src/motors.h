@@ -70,6 +70,7 @@ void enable_motor1(void);
 void disable_motor1(void);
 void enable_motor2(void);
 void disable_motor2(void);
+uint8_t read_lim_switch(uint8_t pin);
 void actuate_motor1(uint16_t period, uint16_t num_cycles, bool forward);
 void actuate_motor2(uint16_t period, uint16_t num_cycles, bool forward);
 
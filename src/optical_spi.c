@@ -32,6 +32,9 @@ bit 4-0 = well number (0-31)
 // tracking if SPI in progress
 bool spi_in_progress = false;
 uint8_t current_well_info = 0;
+// Number of extra requests for current_well_info received while the reading
+// was in progress, which all get the same result
+uint8_t opt_dup_req_count = 0;
 
 bool print_spi_transfers = true;
 
@@ -81,6 +84,7 @@ void send_opt_spi_cmd(uint8_t cmd_opcode, uint8_t well_info) {
     }
 
     // Send the command to PAY-Optical to start reading data    
+    claim_spi_bus();
     set_cs_low(OPT_CS, &OPT_CS_PORT);
     send_spi(tx_bytes[0]);
     set_cs_high(OPT_CS, &OPT_CS_PORT);
@@ -91,6 +95,7 @@ void send_opt_spi_cmd(uint8_t cmd_opcode, uint8_t well_info) {
     set_cs_low(OPT_CS, &OPT_CS_PORT);
     send_spi(tx_bytes[1]);
     set_cs_high(OPT_CS, &OPT_CS_PORT);
+    release_spi_bus();
 
     // Need to give optical time to deassert and assert DATA_RDY
     _delay_ms(100);
@@ -100,6 +105,7 @@ uint32_t get_opt_spi_resp(void) {
     uint8_t rx_bytes[OPT_SPI_RX_COUNT] = {0x00};
 
     // exchange all the required bytes
+    claim_spi_bus();
     for (uint8_t i = 0; i < OPT_SPI_RX_COUNT; i++) {
         set_cs_low(OPT_CS, &OPT_CS_PORT);
         rx_bytes[i] = send_spi(0x00);
@@ -108,6 +114,7 @@ uint32_t get_opt_spi_resp(void) {
         // small delay to give optical time to get SPDR again
         _delay_ms(100);
     }
+    release_spi_bus();
 
     if (print_spi_transfers) {
         print("SPI RX: ");
@@ -128,6 +135,7 @@ void start_opt_spi_get_reading(uint8_t well_info) {
     // set SPI status to "waiting for OPTICAL to respond"
     spi_in_progress = true;
     current_well_info = well_info;
+    opt_dup_req_count = 0;
 }
 
 // function called by PAY-SSM in its main loop 'every once in a while' to check up on OPTICAL after it sent it a command
@@ -145,18 +153,15 @@ void check_opt_spi_get_reading(void){
             // successfully sent command, and received all bytes from OPTICAL
             spi_in_progress = false;
         
-            // create CAN message
-            uint8_t tx_msg[8] = { 0x00 };
-            tx_msg[0] = CAN_PAY_OPT;            // opcode
-            tx_msg[1] = current_well_info;      // field number
-            tx_msg[2] = CAN_STATUS_OK;          // status, 0x00 = ok
-            tx_msg[3] = 0x00;                   // unused
-            tx_msg[4] = 0x00;                   // data bits 4-7 read as uint32_t
-            tx_msg[5] = (opt_spi_data >> 16) & 0xFF; 
-            tx_msg[6] = (opt_spi_data >> 8) & 0xFF;
-            tx_msg[7] = (opt_spi_data) & 0xFF;
-            // Enqueue TX message to transmit
-            enqueue(&tx_msg_queue, tx_msg);
+            // create CAN message(s), one for each request of this well
+            for (uint8_t i = 0; i <= opt_dup_req_count; i++) {
+                enqueue_resp(CAN_PAY_OPT, current_well_info, CAN_STATUS_OK,
+                    opt_spi_data);
+            }
+            opt_dup_req_count = 0;
+
+            save_recent_resp(CAN_PAY_OPT, current_well_info, 0,
+                CAN_STATUS_OK, opt_spi_data);
         }
     }
 
@@ -44,6 +44,7 @@
 
 extern bool spi_in_progress;
 extern uint8_t current_well_info;
+extern uint8_t opt_dup_req_count;
 
 void init_opt_spi(void);
 void rst_opt_spi(void);
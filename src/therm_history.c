@@ -0,0 +1,194 @@
+/*
+History of the heater control passes, kept in a RAM ring buffer so ground can
+see what happened between passes without polling every field every pass.
+
+Each control pass adds a record with the uptime, the 12 thermistor ADC codes
+and the heater/thermistor enables. Most records are stored as the differences
+from the previous record (usually 8 bytes instead of 32). With a key record
+every 16, that averages about 9.5 bytes per record, or 15 if the readings
+change too fast for 4-bit deltas, so the buffer holds about 35-55 passes:
+- 6-9 minutes at the minimum control period (10 s, used while the zones are
+  unsettled)
+- about 1.5 hours at the maximum control period (120 s, zones stable)
+When the buffer is full, the oldest records are overwritten. See
+therm_history.h for the record format.
+
+The whole buffer (oldest record first) can be read over CAN as a multi-frame
+response (CAN_PAY_CTRL_READ_THERM_HIST).
+*/
+
+#include "therm_history.h"
+
+therm_history_t therm_history = {
+    .start = 0,
+    .used = 0,
+    .records = 0,
+    .skipped = 0,
+    .have_prev = false,
+    .reading = false
+};
+
+
+// Returns the total length of a record (bytes) given its header byte
+uint8_t therm_history_record_len(uint8_t header) {
+    uint8_t len = 1;
+    if (header & THERM_HISTORY_KEY) {
+        len += 4 + (2 * THERM_HISTORY_THERM_COUNT);
+    } else if (header & THERM_HISTORY_NIBBLES) {
+        len += 1 + (THERM_HISTORY_THERM_COUNT / 2);
+    } else {
+        len += 1 + THERM_HISTORY_THERM_COUNT;
+    }
+    if (header & THERM_HISTORY_HEATERS) {
+        len += 1;
+    }
+    if (header & THERM_HISTORY_THERMS) {
+        len += 2;
+    }
+    return len;
+}
+
+// Adds a record to the end of the buffer, overwriting the oldest records if
+// there isn't enough space
+void write_therm_history_record(const uint8_t* record, uint8_t len) {
+    while (therm_history.used + len > THERM_HISTORY_LEN) {
+        uint8_t oldest_len = therm_history_record_len(
+            therm_history.buf[therm_history.start]);
+        therm_history.start = (therm_history.start + oldest_len) %
+            THERM_HISTORY_LEN;
+        therm_history.used -= oldest_len;
+    }
+
+    uint16_t pos = (therm_history.start + therm_history.used) %
+        THERM_HISTORY_LEN;
+    for (uint8_t i = 0; i < len; i++) {
+        therm_history.buf[pos] = record[i];
+        pos = (pos + 1) % THERM_HISTORY_LEN;
+    }
+    therm_history.used += len;
+    therm_history.records += 1;
+}
+
+/*
+Adds a record for a control pass.
+time_s - uptime
+codes - THERM_HISTORY_THERM_COUNT thermistor ADC codes
+heaters - heater enables
+therms - thermistor enables
+*/
+void add_therm_history_record(uint32_t time_s, const uint16_t* codes,
+        uint8_t heaters, uint16_t therms) {
+    // Don't change the buffer while it's being read, unless the read seems to
+    // have stopped
+    if (therm_history.reading) {
+        if (time_s - therm_history.read_time_s < THERM_HISTORY_READ_TIMEOUT_S) {
+            therm_history.skipped += 1;
+            return;
+        }
+        therm_history.reading = false;
+    }
+
+    uint8_t record[THERM_HISTORY_MAX_RECORD_LEN];
+    uint8_t len = 1;
+
+    // Use a delta record if possible
+    bool key = !therm_history.have_prev ||
+        therm_history.since_key >= THERM_HISTORY_KEY_INTERVAL - 1 ||
+        time_s - therm_history.prev_time_s > 0xFF;
+    bool nibbles = true;
+    int16_t deltas[THERM_HISTORY_THERM_COUNT];
+    for (uint8_t i = 0; i < THERM_HISTORY_THERM_COUNT && !key; i++) {
+        deltas[i] = (int16_t) codes[i] - (int16_t) therm_history.prev_codes[i];
+        if (deltas[i] < -128 || deltas[i] > 127) {
+            key = true;
+        } else if (deltas[i] < -8 || deltas[i] > 7) {
+            nibbles = false;
+        }
+    }
+
+    if (key) {
+        record[0] = THERM_HISTORY_KEY | THERM_HISTORY_HEATERS |
+            THERM_HISTORY_THERMS;
+        record[len++] = (time_s >> 24) & 0xFF;
+        record[len++] = (time_s >> 16) & 0xFF;
+        record[len++] = (time_s >> 8) & 0xFF;
+        record[len++] = time_s & 0xFF;
+        for (uint8_t i = 0; i < THERM_HISTORY_THERM_COUNT; i++) {
+            record[len++] = (codes[i] >> 8) & 0xFF;
+            record[len++] = codes[i] & 0xFF;
+        }
+        therm_history.since_key = 0;
+    }
+
+    else {
+        record[0] = 0;
+        record[len++] = (uint8_t) (time_s - therm_history.prev_time_s);
+        if (nibbles) {
+            record[0] |= THERM_HISTORY_NIBBLES;
+            for (uint8_t i = 0; i < THERM_HISTORY_THERM_COUNT; i += 2) {
+                record[len++] = ((deltas[i] & 0x0F) << 4) |
+                    (deltas[i + 1] & 0x0F);
+            }
+        } else {
+            for (uint8_t i = 0; i < THERM_HISTORY_THERM_COUNT; i++) {
+                record[len++] = (uint8_t) deltas[i];
+            }
+        }
+        if (heaters != therm_history.prev_heaters) {
+            record[0] |= THERM_HISTORY_HEATERS;
+        }
+        if (therms != therm_history.prev_therms) {
+            record[0] |= THERM_HISTORY_THERMS;
+        }
+        therm_history.since_key += 1;
+    }
+
+    if (record[0] & THERM_HISTORY_HEATERS) {
+        record[len++] = heaters;
+    }
+    if (record[0] & THERM_HISTORY_THERMS) {
+        record[len++] = (therms >> 8) & 0xFF;
+        record[len++] = therms & 0xFF;
+    }
+
+    write_therm_history_record(record, len);
+
+    therm_history.have_prev = true;
+    therm_history.prev_time_s = time_s;
+    for (uint8_t i = 0; i < THERM_HISTORY_THERM_COUNT; i++) {
+        therm_history.prev_codes[i] = codes[i];
+    }
+    therm_history.prev_heaters = heaters;
+    therm_history.prev_therms = therms;
+}
+
+/*
+Starts reading the history from the oldest record, and returns the number of
+bytes to read. No records are added until the last byte is read with
+read_therm_history() (or THERM_HISTORY_READ_TIMEOUT_S passes).
+*/
+uint16_t start_therm_history_read(uint32_t time_s) {
+    therm_history.read_start = therm_history.start;
+    therm_history.read_len = therm_history.used;
+    therm_history.read_time_s = time_s;
+    therm_history.reading = (therm_history.read_len > 0);
+    return therm_history.read_len;
+}
+
+// Returns the 4 bytes of the history starting at offset (from the oldest
+// record), or 0x00 for bytes past the end
+uint32_t read_therm_history(uint16_t offset) {
+    uint32_t data = 0;
+    for (uint16_t i = offset; i < offset + 4; i++) {
+        data <<= 8;
+        if (i < therm_history.read_len) {
+            data |= therm_history.buf[
+                (therm_history.read_start + i) % THERM_HISTORY_LEN];
+        }
+    }
+
+    if (offset + 4 >= therm_history.read_len) {
+        therm_history.reading = false;
+    }
+    return data;
+}
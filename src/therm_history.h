@@ -0,0 +1,85 @@
+#ifndef THERM_HISTORY_H
+#define THERM_HISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/io.h>
+
+// Number of thermistor readings in each record (same as THERMISTOR_COUNT)
+#define THERM_HISTORY_THERM_COUNT   12
+// Size of the history buffer (bytes) - about 35-55 records (see
+// therm_history.c)
+#define THERM_HISTORY_LEN           512
+// A full (key) record is written at least this often, so the history can be
+// decoded again soon after the oldest records are overwritten
+#define THERM_HISTORY_KEY_INTERVAL  16
+// Recording resumes if a read takes longer than this (seconds)
+#define THERM_HISTORY_READ_TIMEOUT_S    30
+
+/*
+Record header byte - bits for which fields follow
+
+Key record (THERM_HISTORY_KEY set):
+- uptime (4 bytes)
+- thermistor ADC codes (2 bytes each)
+
+Delta record (THERM_HISTORY_KEY not set):
+- seconds since the last record (1 byte)
+- change in each thermistor ADC code since the last record, either as signed
+  4-bit values packed two per byte (first thermistor in the high nibble) if
+  THERM_HISTORY_NIBBLES is set, or as signed bytes
+
+Then in either record:
+- heater enables (1 byte) if THERM_HISTORY_HEATERS is set
+- thermistor enables (2 bytes) if THERM_HISTORY_THERMS is set (key records
+  always have both)
+
+All multi-byte values are big endian.
+*/
+#define THERM_HISTORY_KEY       _BV(7)
+#define THERM_HISTORY_NIBBLES   _BV(6)
+#define THERM_HISTORY_HEATERS   _BV(5)
+#define THERM_HISTORY_THERMS    _BV(4)
+
+// Longest record (key record)
+#define THERM_HISTORY_MAX_RECORD_LEN (1 + 4 + (2 * THERM_HISTORY_THERM_COUNT) + 1 + 2)
+
+typedef struct {
+    // Position of the oldest record in buf
+    uint16_t start;
+    // Number of bytes used
+    uint16_t used;
+    // Total number of records ever added (wraps around)
+    uint16_t records;
+    // Number of records not added because the history was being read
+    uint16_t skipped;
+
+    // Last record added, for calculating the deltas
+    bool have_prev;
+    uint32_t prev_time_s;
+    uint16_t prev_codes[THERM_HISTORY_THERM_COUNT];
+    uint8_t prev_heaters;
+    uint16_t prev_therms;
+    // Records since the last key record
+    uint8_t since_key;
+
+    // true while the history is being read (over CAN), so it doesn't change
+    bool reading;
+    uint32_t read_time_s;
+    // Snapshot of start/used when the read started
+    uint16_t read_start;
+    uint16_t read_len;
+
+    uint8_t buf[THERM_HISTORY_LEN];
+} therm_history_t;
+
+extern therm_history_t therm_history;
+
+void add_therm_history_record(uint32_t time_s, const uint16_t* codes,
+    uint8_t heaters, uint16_t therms);
+uint8_t therm_history_record_len(uint8_t header);
+uint16_t start_therm_history_read(uint32_t time_s);
+uint32_t read_therm_history(uint16_t offset);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+Integer conversion from 12-bit ADC thermistor readings to temperature, for use
+in the heater control loop instead of adc_raw_to_therm_temp() (which does
+several soft-float operations and a table search for each conversion).
+
+The table holds the temperature in centi-degrees C (e.g. 1397 = 13.97 C) for
+every THERM_LUT_STEP ADC codes, generated from the same thermistor resistance
+table and voltage divider as adc_raw_to_therm_temp() in lib-common. Entries
+past either end of the resistance table are extrapolated from the end segments
+so interpolation near the ends stays accurate, then results are clamped to
+[THERM_LUT_MIN_CENTI, THERM_LUT_MAX_CENTI].
+
+The check against adc_raw_to_therm_temp() for every ADC code runs on the board
+in the therm_lut_test harness test (harness_tests/commands), not as a host
+test, since the reference conversion and its resistance table live in
+lib-common's AVR build.
+
+The table is in flash (PROGMEM), so it adds no static RAM.
+*/
+
+#include "therm_lut.h"
+
+const int16_t therm_lut[THERM_LUT_COUNT] PROGMEM = {
+    -32768, -15310,  -8572,  -6326,  -5203,  -4530,  -4080,  -3759,
+     -3519,  -3271,  -3066,  -2864,  -2676,  -2517,  -2341,  -2183,
+     -2045,  -1898,  -1755,  -1627,  -1511,  -1378,  -1254,  -1141,
+     -1037,   -923,   -809,   -703,   -605,   -514,   -407,   -304,
+      -208,   -117,    -31,     63,    161,    253,    341,    424,
+       504,    599,    690,    776,    859,    938,   1016,   1107,
+      1195,   1278,   1359,   1436,   1512,   1602,   1688,   1771,
+      1851,   1929,   2004,   2094,   2181,   2265,   2346,   2425,
+      2501,   2593,   2681,   2767,   2850,   2931,   3012,   3107,
+      3198,   3287,   3374,   3458,   3549,   3648,   3743,   3836,
+      3927,   4019,   4124,   4227,   4327,   4425,   4524,   4638,
+      4748,   4856,   4962,   5079,   5201,   5320,   5437,   5562,
+      5697,   5829,   5958,   6103,   6254,   6402,   6556,   6726,
+      6893,   7067,   7257,   7443,   7649,   7861,   8082,   8323,
+      8571,   8846,   9135,   9444,   9788,  10157,  10566,  11025,
+     11552,  12154,  12821,  13477,  14123,  14758,  15383,  15998,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582,  16582,  16582,  16582,  16582,  16582,  16582,  16582,
+     16582
+};
+
+
+// Returns the temperature for a raw ADC reading, in centi-degrees C
+int16_t adc_raw_to_therm_centi(uint16_t raw_data) {
+    return adc_raw_frac_to_therm_centi(raw_data, 0);
+}
+
+/*
+Same as adc_raw_to_therm_centi(), but raw_data has frac_bits fractional bits
+(e.g. an averaged reading), which are used in the interpolation.
+*/
+int16_t adc_raw_frac_to_therm_centi(uint32_t raw_data, uint8_t frac_bits) {
+    if (raw_data > (0x0FFFUL << frac_bits)) {
+        raw_data = 0x0FFFUL << frac_bits;
+    }
+
+    // ADC counts (with fractional bits) between table entries
+    uint32_t step = (uint32_t) THERM_LUT_STEP << frac_bits;
+    uint16_t index = raw_data / step;
+    int32_t frac = raw_data % step;
+
+    int32_t low = (int16_t) pgm_read_word(&therm_lut[index]);
+    int32_t high = (int16_t) pgm_read_word(&therm_lut[index + 1]);
+    // Linear interpolation between the two nearest entries
+    int32_t temp = low + (((high - low) * frac) / (int32_t) step);
+
+    if (temp < THERM_LUT_MIN_CENTI) {
+        return THERM_LUT_MIN_CENTI;
+    } else if (temp > THERM_LUT_MAX_CENTI) {
+        return THERM_LUT_MAX_CENTI;
+    } else {
+        return (int16_t) temp;
+    }
+}
+
+/*
+Returns the lowest ADC code that converts to at least temp (in centi-degrees C),
+or 0x1000 if there is none. Since the conversion is monotonic, for any raw
+reading: raw < therm_centi_to_adc_raw(temp) exactly when
+adc_raw_to_therm_centi(raw) < temp. This lets limits be compared in raw ADC
+counts without converting each reading.
+*/
+uint16_t therm_centi_to_adc_raw(int16_t temp) {
+    // Binary search in [low, high)
+    uint16_t low = 0;
+    uint16_t high = 0x1000;
+    while (low < high) {
+        uint16_t mid = low + ((high - low) / 2);
+        if (adc_raw_to_therm_centi(mid) < temp) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
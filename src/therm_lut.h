@@ -0,0 +1,25 @@
+#ifndef THERM_LUT_H
+#define THERM_LUT_H
+
+#include <stdint.h>
+
+#include <avr/pgmspace.h>
+
+// Number of ADC codes between lookup table entries
+#define THERM_LUT_STEP      16
+// Number of entries (covers ADC codes 0x000 to 0x1000)
+#define THERM_LUT_COUNT     ((0x1000 / THERM_LUT_STEP) + 1)
+
+// Range of the thermistor resistance table used by adc_raw_to_therm_temp(), in
+// centi-degrees C - converted temperatures are clamped to this range
+#define THERM_LUT_MIN_CENTI (-4000)
+#define THERM_LUT_MAX_CENTI 12500
+
+// Maximum difference from adc_raw_to_therm_temp() within the table range (C)
+#define THERM_LUT_TOLERANCE 0.2
+
+int16_t adc_raw_to_therm_centi(uint16_t raw_data);
+int16_t adc_raw_frac_to_therm_centi(uint32_t raw_data, uint8_t frac_bits);
+uint16_t therm_centi_to_adc_raw(int16_t temp);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+Learns how each heater zone responds to its heater, so the heater control can
+predict what a duty cycle will do instead of only reacting to the thermistors
+afterwards (see heaters.c).
+
+After every control pass, the zone's rate of change during the pass and the
+fraction of the pass its heater was actually ON are used to update a
+2-parameter model (see thermal_model_t) by recursive least squares with a
+forgetting factor. This is all integer math (64-bit in the intermediate steps),
+since it only runs once per control pass for each zone.
+*/
+
+#include "thermal_model.h"
+
+// Clamps a value to [-max, max]
+int64_t clamp_thermal_model(int64_t value, int64_t max) {
+    if (value < -max) {
+        return -max;
+    }
+    if (value > max) {
+        return max;
+    }
+    return value;
+}
+
+// Forgets the parameters and starts learning again
+void reset_thermal_model(thermal_model_t* model) {
+    model->gain = 0;
+    model->offset = 0;
+    model->p_gain = THERMAL_MODEL_P_INIT;
+    model->p_cross = 0;
+    model->p_offset = THERMAL_MODEL_P_INIT;
+    model->updates = 0;
+}
+
+/*
+Updates the model with one control pass.
+duty - fraction of the pass the heater was ON (percent)
+rate - rate of change of the zone temperature during the pass (centi-degrees C
+       per minute)
+*/
+void update_thermal_model(thermal_model_t* model, uint8_t duty, int32_t rate) {
+    rate = (int32_t) clamp_thermal_model(rate, THERMAL_MODEL_RATE_MAX);
+    int64_t u = duty;
+    int64_t bias = THERMAL_MODEL_BIAS;
+
+    // P * phi, where phi = [duty, bias]
+    int64_t v_gain = (model->p_gain * u) + (model->p_cross * bias);
+    int64_t v_offset = (model->p_cross * u) + (model->p_offset * bias);
+
+    // lambda + phi' * P * phi is always at least lambda unless P was damaged
+    // by rounding, in which case start the covariance over and skip this pass
+    int64_t den = THERMAL_MODEL_LAMBDA + (u * v_gain) + (bias * v_offset);
+    if (den < THERMAL_MODEL_LAMBDA) {
+        model->p_gain = THERMAL_MODEL_P_INIT;
+        model->p_cross = 0;
+        model->p_offset = THERMAL_MODEL_P_INIT;
+        return;
+    }
+
+    // RLS gain
+    int64_t k_gain = (v_gain * THERMAL_MODEL_P_ONE) / den;
+    int64_t k_offset = (v_offset * THERMAL_MODEL_P_ONE) / den;
+
+    // Prediction error (fixed point)
+    int64_t err = ((int64_t) rate << THERMAL_MODEL_FRAC_BITS) -
+        ((model->gain * u) + (model->offset * bias));
+
+    model->gain = (int32_t) clamp_thermal_model(
+        model->gain + ((k_gain * err) / THERMAL_MODEL_P_ONE),
+        THERMAL_MODEL_PARAM_MAX);
+    model->offset = (int32_t) clamp_thermal_model(
+        model->offset + ((k_offset * err) / THERMAL_MODEL_P_ONE),
+        THERMAL_MODEL_PARAM_MAX);
+
+    // P = (P - K * (P * phi)') / lambda
+    int64_t p_gain = model->p_gain - ((k_gain * v_gain) / THERMAL_MODEL_P_ONE);
+    int64_t p_cross = model->p_cross - ((k_gain * v_offset) / THERMAL_MODEL_P_ONE);
+    int64_t p_offset = model->p_offset -
+        ((k_offset * v_offset) / THERMAL_MODEL_P_ONE);
+    p_gain = (p_gain * THERMAL_MODEL_P_ONE) / THERMAL_MODEL_LAMBDA;
+    p_cross = (p_cross * THERMAL_MODEL_P_ONE) / THERMAL_MODEL_LAMBDA;
+    p_offset = (p_offset * THERMAL_MODEL_P_ONE) / THERMAL_MODEL_LAMBDA;
+
+    // Keep the diagonal positive and everything within THERMAL_MODEL_P_INIT
+    model->p_gain = (int32_t) clamp_thermal_model(p_gain, THERMAL_MODEL_P_INIT);
+    model->p_cross = (int32_t) clamp_thermal_model(p_cross, THERMAL_MODEL_P_INIT);
+    model->p_offset = (int32_t) clamp_thermal_model(p_offset,
+        THERMAL_MODEL_P_INIT);
+    if (model->p_gain < 1) {
+        model->p_gain = 1;
+    }
+    if (model->p_offset < 1) {
+        model->p_offset = 1;
+    }
+
+    if (model->updates < UINT16_MAX) {
+        model->updates += 1;
+    }
+}
+
+// Returns true if the model has learned enough to be used
+bool thermal_model_valid(const thermal_model_t* model) {
+    return model->updates >= THERMAL_MODEL_MIN_UPDATES &&
+        model->gain >= THERMAL_MODEL_GAIN_MIN;
+}
+
+// Returns the rate of change with the heater OFF (fixed point centi-degrees C
+// per minute)
+int32_t thermal_model_off_rate(const thermal_model_t* model) {
+    return model->offset * THERMAL_MODEL_BIAS;
+}
+
+// Returns the predicted rate of change at a duty cycle (centi-degrees C per
+// minute)
+int32_t thermal_model_rate(const thermal_model_t* model, uint8_t duty) {
+    int32_t rate = (model->gain * duty) + thermal_model_off_rate(model);
+    return rate / (1L << THERMAL_MODEL_FRAC_BITS);
+}
+
+/*
+Returns the duty cycle (0 to 100 percent) predicted to give a rate of change
+(centi-degrees C per minute), e.g. a rate of 0 gives the duty cycle that holds
+the temperature. The model must be valid.
+*/
+uint8_t thermal_model_duty_for_rate(const thermal_model_t* model, int32_t rate) {
+    if (model->gain <= 0) {
+        return 0;
+    }
+
+    rate = (int32_t) clamp_thermal_model(rate, THERMAL_MODEL_RATE_MAX);
+    int32_t duty = (((int32_t) rate << THERMAL_MODEL_FRAC_BITS) -
+        thermal_model_off_rate(model)) / model->gain;
+
+    if (duty < 0) {
+        return 0;
+    }
+    if (duty > 100) {
+        return 100;
+    }
+    return (uint8_t) duty;
+}
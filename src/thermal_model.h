@@ -0,0 +1,63 @@
+#ifndef THERMAL_MODEL_H
+#define THERMAL_MODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The parameters are fixed point, with this many fractional bits
+#define THERMAL_MODEL_FRAC_BITS     8
+// The covariance and the RLS gain are fixed point, with this many fractional
+// bits
+#define THERMAL_MODEL_P_FRAC_BITS   24
+#define THERMAL_MODEL_P_ONE         ((int64_t) 1 << THERMAL_MODEL_P_FRAC_BITS)
+// Starting covariance (large compared to 1 / duty^2, so the first updates fit
+// the data quickly), which is also the maximum so it can't grow without limit
+// while the duty cycle doesn't change
+#define THERMAL_MODEL_P_INIT        ((int32_t) THERMAL_MODEL_P_ONE)
+// Forgetting factor (0.98), so the model follows slow changes (e.g. orbit
+// environment)
+#define THERMAL_MODEL_LAMBDA        16441672L
+// The constant term is multiplied by this instead of 1, so both terms of the
+// model are on the same scale as the duty cycle (percent)
+#define THERMAL_MODEL_BIAS          100
+// Rates of change are limited to this (centi-degrees C per minute) before
+// they are used, so a bad reading can't throw off the model
+#define THERMAL_MODEL_RATE_MAX      2000
+// Limit for the parameters (fixed point)
+#define THERMAL_MODEL_PARAM_MAX     ((int32_t) 10000 << THERMAL_MODEL_FRAC_BITS)
+// The model is only used once it has this many updates, and heating the zone
+// by at least this much (fixed point centi-degrees C per minute per percent)
+#define THERMAL_MODEL_MIN_UPDATES   8
+#define THERMAL_MODEL_GAIN_MIN      ((int32_t) 1 << (THERMAL_MODEL_FRAC_BITS - 2))
+
+/*
+First-order model of how fast one heater zone's temperature changes:
+rate = gain * duty + offset * THERMAL_MODEL_BIAS
+rate - centi-degrees C per minute
+duty - heater duty cycle (percent)
+gain, offset - fixed point with THERMAL_MODEL_FRAC_BITS fractional bits
+
+offset * THERMAL_MODEL_BIAS is the rate with the heater OFF (heat lost to the
+surroundings, which is treated as constant near the setpoint and tracked by the
+forgetting factor).
+*/
+typedef struct {
+    int32_t gain;
+    int32_t offset;
+    // Covariance matrix (symmetric, so only 3 entries), fixed point with
+    // THERMAL_MODEL_P_FRAC_BITS fractional bits
+    int32_t p_gain;
+    int32_t p_cross;
+    int32_t p_offset;
+    // Number of updates since the last reset (stops at UINT16_MAX)
+    uint16_t updates;
+} thermal_model_t;
+
+void reset_thermal_model(thermal_model_t* model);
+void update_thermal_model(thermal_model_t* model, uint8_t duty, int32_t rate);
+bool thermal_model_valid(const thermal_model_t* model);
+int32_t thermal_model_off_rate(const thermal_model_t* model);
+int32_t thermal_model_rate(const thermal_model_t* model, uint8_t duty);
+uint8_t thermal_model_duty_for_rate(const thermal_model_t* model, int32_t rate);
+
+#endif